@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/* Bump allocator for things that all die together, like the nodes of one tree.
+ * Memory is handed out from blocks that only ever grow and is returned all at once when the arena goes away.
+ * Destructors of the objects in it are not run, so they must not own anything outside of the arena.
+ * The arena that make() and arena_allocator use by default is the one installed for the current thread.
+ */
+class arena {
+	static constexpr size_t first_block = 64 << 10, max_block = 4 << 20;
+	std::vector<std::unique_ptr<char[]>> blocks;
+	char *at = nullptr, *end = nullptr;
+	size_t block_size = first_block;
+	size_t used_bytes = 0, reserved_bytes = 0;
+
+	void grow(size_t n) {
+		size_t size = std::max(block_size, n);
+		blocks.emplace_back(new char[size]);
+		at = blocks.back().get();
+		end = at + size;
+		reserved_bytes += size;
+		block_size = std::min(block_size * 2, max_block);
+	}
+	static inline thread_local arena *installed = nullptr;
+
+public:
+	arena() = default;
+	arena(const arena &) = delete;
+
+	void* allocate(size_t n, size_t align) {
+		char *p = (char*)(((uintptr_t)at + align-1) & ~(uintptr_t)(align-1));
+		if (!at || p + n > end) {
+			grow(n + align);
+			p = (char*)(((uintptr_t)at + align-1) & ~(uintptr_t)(align-1));
+		}
+		at = p + n;
+		used_bytes += n;
+		return p;
+	}
+	template<typename T, typename... Args> T* make(Args&&... args) {
+		return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+
+	size_t used() const { return used_bytes; }
+	size_t reserved() const { return reserved_bytes; }
+	size_t block_count() const { return blocks.size(); }
+
+	static arena& current() {
+		assert(installed && "no arena installed for this thread, see arena::use");
+		return *installed;
+	}
+	// installs an arena for the current thread while in scope
+	class use {
+		arena *previous;
+	public:
+		use(arena &a) : previous(installed) { installed = &a; }
+		~use() { installed = previous; }
+	};
+};
+
+// for containers inside of arena objects, takes the current arena when constructed; nothing is ever freed
+template<typename T> struct arena_allocator {
+	using value_type = T;
+	arena *owner;
+	arena_allocator() : owner(&arena::current()) {}
+	template<typename U> arena_allocator(const arena_allocator<U> &other) : owner(other.owner) {}
+	T* allocate(size_t n) { return (T*)owner->allocate(n * sizeof(T), alignof(T)); }
+	void deallocate(T*, size_t) {}
+	template<typename U> bool operator==(const arena_allocator<U> &other) const { return owner == other.owner; }
+};
+
+/* A vector for objects in an arena, with room for N elements inline. More elements move to the current arena.
+ * Meant for the short lists of tree nodes: most of them never allocate, and the rest are usually sized once.
+ * Like everything in an arena its elements are never destroyed, and it cannot be copied since nodes are not either.
+ */
+template<typename T, unsigned N> class small_vector {
+	static_assert(std::is_trivially_destructible_v<T>, "elements are never destroyed");
+	T *spilled = nullptr;
+	uint32_t count = 0, capacity = N;
+	alignas(T) unsigned char inline_items[N * sizeof(T)];
+
+	void grow(uint32_t n) {
+		T *items = (T*)arena::current().allocate(n * sizeof(T), alignof(T));
+		for (uint32_t i = 0; i < count; ++i)
+			new (items + i) T(data()[i]);
+		spilled = items;
+		capacity = n;
+	}
+public:
+	small_vector() = default;
+	small_vector(const small_vector &) = delete;
+	// takes the elements of another container, with exactly the room needed
+	template<typename Range> explicit small_vector(const Range &from) {
+		if (from.size() > N)
+			grow(from.size());
+		for (const T &x : from)
+			new (data() + count++) T(x);
+	}
+
+	T* data() { return spilled ? spilled : (T*)inline_items; }
+	const T* data() const { return spilled ? spilled : (const T*)inline_items; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	T* begin() { return data(); }
+	T* end() { return data() + count; }
+	const T* begin() const { return data(); }
+	const T* end() const { return data() + count; }
+	T& operator[](size_t i) { return data()[i]; }
+	const T& operator[](size_t i) const { return data()[i]; }
+	T& front() { return data()[0]; }
+	T& back() { return data()[count-1]; }
+
+	template<typename... Args> T& emplace_back(Args&&... args) {
+		if (count == capacity)
+			grow(2 * capacity);
+		return *new (data() + count++) T(std::forward<Args>(args)...);
+	}
+	void push_back(const T &x) { emplace_back(x); }
+};
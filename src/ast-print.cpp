@@ -1,15 +1,13 @@
 #include "tree.h"
 
 #include <numeric>
-#include <typeinfo>
 #include <string>
 #include <iostream>
+#include <iterator>
 #include <tuple>
 
 using std::string;
 
-std::string demangle(const std::string &name); // see below, copied from S/O
-
 namespace ast {
 
 #define indent indent_block indent_for_this_node(this)
@@ -17,31 +15,27 @@ namespace ast {
 
 	void printer::visit(conditional *node) {
 		header("conditional");
-		node->condition->traverse_with(this);
-		node->consequent->traverse_with(this);
-		node->alternative->traverse_with(this);
+		traverse(node->condition);
+		traverse(node->consequent);
+		traverse(node->alternative);
 		out << ")";
 	}
 	void printer::visit(n_ary *node) {
-		string name = typeid(*node).name();
-		name = demangle(name);
-		if (name.find_last_of(":") != string::npos)
-			name = name.substr(name.find_last_of(":")+1);
-		header(name);
-		if (std::transform_reduce(node->operands.begin(), node->operands.end(), true, std::logical_and{},
-						[](pointer_to<expression> e){ return e->is<literal>(); })) {
+		header(name(node->tag));
+		if (std::transform_reduce(node->terms.begin(), node->terms.end(), true, std::logical_and{},
+						[](const n_ary::term &t){ return t.operand->is<literal>(); })) {
 			// all operands are literals
-			node->operands.front()->traverse_with(this);;
-			for (int i = 0; i < node->infix_ops.size(); ++i) {
-				out << " " << node->infix_ops[i].text << " ";
-				node->operands[i+1]->traverse_with(this);
+			traverse(node->terms.front().operand);
+			for (size_t i = 1; i < node->terms.size(); ++i) {
+				out << " " << text(node->terms[i].op) << " ";
+				traverse(node->terms[i].operand);
 			}
 		}
 		else {
-			node->operands.front()->traverse_with(this);
-			for (int i = 0; i < node->infix_ops.size(); ++i) {
-				out << ind() << node->infix_ops[i].text << " ";
-				node->operands[i+1]->traverse_with(this);
+			traverse(node->terms.front().operand);
+			for (size_t i = 1; i < node->terms.size(); ++i) {
+				out << ind() << text(node->terms[i].op) << " ";
+				traverse(node->terms[i].operand);
 			}
 		}
 		out << ")";
@@ -49,51 +43,51 @@ namespace ast {
 	
 	void printer::visit(cast *node) {
 		header("cast");
-		node->type->traverse_with(this);
-		node->expr->traverse_with(this);
+		traverse(node->type);
+		traverse(node->expr);
 		out << ")";
 	}
 
 	void printer::visit(unary *node) {
 		header("unary");
-		out << " " << node->op.text;
-		node->sub->traverse_with(this);
+		out << " " << text(node->op);
+		traverse(node->sub);
 		out << ")";
 	}
 
 	void printer::visit(call *node) {
 		header("call");
-		node->callee->traverse_with(this);
+		traverse(node->callee);
 		for (auto arg : node->arguments)
-			arg->traverse_with(this);
+			traverse(arg);
 		out << ")";
 	}
 
 	void printer::visit(subscript *node) {
 		header("subscript");
-		node->array->traverse_with(this);
-		node->index->traverse_with(this);
+		traverse(node->array);
+		traverse(node->index);
 		out << ")";
 	}
 
 	void printer::visit(member_access *node) {
 		header("member-access");
-		node->outer->traverse_with(this);
-		node->inner->traverse_with(this);
+		traverse(node->outer);
+		traverse(node->inner);
 		out << ")";
 	}
 
 	void printer::visit(identifier *node) {
-		out << ind() << node->token.text;
+		out << ind() << text(node->token);
 	}
 
 	void printer::visit(literal *node) {
-		out << ind() << node->token.text;
+		out << ind() << text(node->token);
 	}
 		
 	void printer::visit(string_lit *node) {
 		string escaped;
-		for (char c : node->token.text)
+		for (char c : text(node->token))
 			switch (c) {
 			case '\n': escaped += "\\n";  break;
 			case '\t': escaped += "\\t";  break;
@@ -105,21 +99,23 @@ namespace ast {
 	}
 	
 	void printer::visit(translation_unit *node) {
-		for (auto x : node->toplevel)
-			x->traverse_with(this);
+		for (size_t i = 0; i < node->toplevel.size(); ++i) {
+			tokens = &node->tokens_of(i);
+			traverse(node->toplevel[i]);
+		}
 		out << "\n";
 	}
 	
 	void printer::visit(declaration_specifiers *node) {
 		header("decl-spec");
 		for (auto x : node->specifiers)
-			out << " " << x->token.text;
-		node->type->traverse_with(this);
+			out << " " << text(x->token);
+		traverse(node->type);
 		out << ")";
 	}
 	
 	void printer::visit(type_specifier *node) {
-		out << ind() << "(type " << node->token.text << ")";
+		out << ind() << "(type " << text(node->token) << ")";
 	}
 	
 	void printer::visit(declarator *node) {
@@ -131,12 +127,12 @@ namespace ast {
 			if (p.r) out << " restrict";
 		}
 		if (node->name)
-			node->name->traverse_with(this);
+			traverse(node->name);
 		if (node->array.size()) {
 			header("array");
 			for (auto x : node->array)
 				if (x)
-					x->traverse_with(this);
+					traverse(x);
 				else
 					out << ind() << "null";
 			out << ")";
@@ -145,7 +141,7 @@ namespace ast {
 			header("fn-parameters");
 			for (auto x : node->fn_params)
 				if (x)
-					x->traverse_with(this);
+					traverse(x);
 				else
 					out << ind() << "null";
 			if (node->ellipsis)
@@ -157,11 +153,11 @@ namespace ast {
 
 	void printer::visit(var_declarations *node) {
 		header("declarations");
-		if (node->specifiers)  node->specifiers->traverse_with(this);
+		if (node->specifiers)  traverse(node->specifiers);
 		for (auto [decl,init,width] : node->init_declarators) {
-			decl->traverse_with(this);
-			if (init)  init->traverse_with(this);
-			if (width) width->traverse_with(this);
+			traverse(decl);
+			if (init)  traverse(init);
+			if (width) traverse(width);
 		}
 		out << ")";	
 	}
@@ -169,88 +165,94 @@ namespace ast {
 	void printer::visit(function_definition *node) {
 		header("function-definition");
 		if (node->specifiers)
-			node->specifiers->traverse_with(this);
-		node->declarator->traverse_with(this);
-		node->block->traverse_with(this);
+			traverse(node->specifiers);
+		traverse(node->declarator);
+		traverse(node->block);
 		out << ")";	
 	}
 	
 	void printer::visit(struct_union *node) {
-		header(node->kind.text);
-		if (node->name()) out << " " << node->name()->token.text;
+		header(text(node->kind));
+		if (node->name()) out << " " << text(node->name()->token);
 		for (auto x : node->declarations)
-			x->traverse_with(this);
+			traverse(x);
 	}
 
 	void printer::visit(enumeration *node) {
 		header("enum");
-		if (node->name) out << " " << node->name->token.text;
+		if (node->name) out << " " << text(node->name->token);
 		for (auto [n,v] : node->enumerators) {
-			out << ind() << n->token.text;
+			out << ind() << text(n->token);
 			if (v) {
 				out << " = ";
-				v->traverse_with(this);
+				traverse(v);
 			}
 		}
 		out << ")";
 	}
 
 	void printer::visit(expression_stmt *node) {
-		node->expression->traverse_with(this);
+		traverse(node->expression);
 	}
 
+	// 'else if' chains are printed nested, but in a loop: the parser does not limit their length
 	void printer::visit(if_stmt *node) {
-		header("if");
-		node->condition->traverse_with(this);
-		node->consequent->traverse_with(this);
-		if (node->alternate)
-			node->alternate->traverse_with(this);
-		out << ")";
+		int chain = 0;
+		for (auto n = node; n; n = dyn_cast<if_stmt>(n->alternate), ++chain) {
+			out << ind() << "(if";
+			indent_size += 2;
+			traverse(n->condition);
+			traverse(n->consequent);
+			if (n->alternate && !isa<if_stmt>(n->alternate))
+				traverse(n->alternate);
+		}
+		indent_size -= 2 * chain;
+		out << std::string(chain, ')');
 	}
 
 	void printer::visit(switch_stmt *node) {
 		header("switch");
-		node->expression->traverse_with(this);
+		traverse(node->expression);
 		if (node->body)
-			node->body->traverse_with(this);
+			traverse(node->body);
 		out << ")";
 	}
 
 	void printer::visit(jump_stmt *node) {
-		header(node->kind.text);
+		header(text(node->kind));
 		if (node->expression)
-			node->expression->traverse_with(this);
+			traverse(node->expression);
 		out << ")";
 	}
 
 	void printer::visit(label_stmt *node) {
 		header("label");
-		if (node->keyword) out << " " << node->keyword->text;
+		if (node->keyword) out << " " << text(node->keyword);
 		if (node->label)
-			node->label->traverse_with(this);
+			traverse(node->label);
 		out << ")";
 	}
 
 	void printer::visit(loop_stmt *node) {
 		header("loop");
-		node->condition->traverse_with(this);
-		node->body->traverse_with(this);
+		traverse(node->condition);
+		traverse(node->body);
 		out << ")";
 	}
 
 	void printer::visit(for_loop *node) {
 		header("for");
-		if (node->init) node->init->traverse_with(this);
-		if (node->condition) node->condition->traverse_with(this);
-		if (node->step) node->step->traverse_with(this);
-		node->body->traverse_with(this);
+		if (node->init) traverse(node->init);
+		if (node->condition) traverse(node->condition);
+		if (node->step) traverse(node->step);
+		traverse(node->body);
 		out << ")";
 	}
 
 	void printer::visit(block *node) {
 		header("block");
 		for (auto x : node->statements) {
-			x->traverse_with(this);
+			traverse(x);
 		}
 		out << ")";
 	}
@@ -258,26 +260,45 @@ namespace ast {
 
 	
 	
-	void print(pointer_to<node> ast) {
-		printer p(std::cout);
-		ast->traverse_with(&p);
+	void printer::traverse(node *n) {
+		flush();
+		traversed.push_back({ n, {}, indent_size, tokens });
 	}
 
-}
+	void printer::print(node *root) {
+		todo.push_back({ root, {}, indent_size, tokens });
+		while (!todo.empty()) {
+			pending p = std::move(todo.back());
+			todo.pop_back();
+			if (!p.n) {
+				dest << p.text;
+				continue;
+			}
+			indent_size = p.indent_size;
+			tokens = p.tokens;
+			out.rdbuf(dest.rdbuf());	// everything before this node is printed already
+			static_visitor::traverse(p.n);
+			flush();
+			todo.insert(todo.end(), std::make_move_iterator(traversed.rbegin()), std::make_move_iterator(traversed.rend()));
+			traversed.clear();
+		}
+	}
 
+	void printer::flush() {
+		if (out.rdbuf() != &after) {
+			out.rdbuf(&after);
+			return;
+		}
+		if (after.text.empty())
+			return;
+		traversed.push_back({ nullptr, after.text, 0, nullptr });
+		after.text.clear();
+	}
 
-// https://stackoverflow.com/a/4541470
-#include <cstdlib>
-#include <memory>
-#include <cxxabi.h>
+	void print(pointer_to<node> ast) {
+		printer p(std::cout);
+		p.print(ast);
+	}
 
-std::string demangle(const std::string &name) {
-	int status = -4; // some arbitrary value to eliminate the compiler warning
-	// enable c++11 by passing the flag -std=c++11 to g++
-	std::unique_ptr<char, void(*)(void*)> res {
-		abi::__cxa_demangle(name.c_str(), NULL, NULL, &status),
-			std::free
-	};
-	return (status==0) ? res.get() : name.c_str() ;
 }
 
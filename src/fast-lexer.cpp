@@ -0,0 +1,403 @@
+#include "token.h"
+#include "source.h"
+#include "scan.h"
+
+#include <array>
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+
+/* A hand-written scanner that yields exactly the token stream of the flex scanner in lexer.ll, only faster.
+ *
+ * That includes the details of what flex reports: attribute blocks are returned at every closing parenthesis, for
+ * example. Whenever lexer.ll changes this has to follow, test/lexer.test compares both backends.
+ * Comments, strings and attributes are skipped with the block scans of scan.h rather than byte by byte.
+ */
+
+namespace {
+	enum char_class : uint8_t { space = 1, newline = 2, digit = 4, alpha = 8 };
+
+	constexpr std::array<uint8_t, 256> make_char_classes() {
+		std::array<uint8_t, 256> cls {};
+		for (unsigned char c : std::string_view(" \t\r\b"))
+			cls[c] = space;
+		cls['\n'] = newline;
+		for (int c = '0'; c <= '9'; ++c) cls[c] = digit;
+		for (int c = 'a'; c <= 'z'; ++c) cls[c] = alpha;
+		for (int c = 'A'; c <= 'Z'; ++c) cls[c] = alpha;
+		cls['_'] = alpha;
+		return cls;
+	}
+	constexpr auto char_classes = make_char_classes();
+
+	inline uint8_t char_class(char c) { return char_classes[(unsigned char)c]; }
+	inline bool is_digit(char c) { return char_class(c) & digit; }
+	inline bool is_alnum(char c) { return char_class(c) & (digit|alpha); }
+	inline bool is_white(char c) { return char_class(c) & (space|newline); }
+
+	struct keyword {
+		std::string_view text;
+		enum token::type type = token::identifier;
+	};
+	constexpr keyword keywords[] = {
+		{ "sizeof", token::size_of }, { "void", token::kw_void }, { "char", token::kw_char }, { "short", token::kw_short },
+		{ "int", token::kw_int }, { "long", token::kw_long }, { "float", token::kw_float }, { "double", token::kw_double },
+		{ "_Bool", token::kw_bool }, { "_Complex", token::kw_complex }, { "signed", token::kw_signed },
+		{ "unsigned", token::kw_unsigned }, { "const", token::kw_const }, { "volatile", token::kw_volatile },
+		{ "struct", token::kw_struct }, { "union", token::kw_union }, { "enum", token::kw_enum },
+		{ "static", token::kw_static }, { "auto", token::kw_auto }, { "extern", token::kw_extern },
+		{ "register", token::kw_register }, { "typedef", token::kw_typedef }, { "restrict", token::kw_restrict },
+		{ "__restrict", token::kw_restrict }, { "__restrict__", token::kw_restrict },
+		{ "if", token::kw_if }, { "else", token::kw_else }, { "switch", token::kw_switch }, { "return", token::kw_return },
+		{ "break", token::kw_break }, { "continue", token::kw_continue }, { "case", token::kw_case },
+		{ "default", token::kw_default }, { "while", token::kw_while }, { "do", token::kw_do }, { "for", token::kw_for },
+		{ "goto", token::kw_goto },
+	};
+
+	// perfect for the keywords above, the factors were found by trying small ones
+	constexpr unsigned keyword_slots = 128;
+	constexpr unsigned keyword_hash(std::string_view s) {
+		return ((unsigned char)s[0] + (unsigned char)s[s.size()-1]*31 + (unsigned char)s[s.size()/2] + s.size()*5) % keyword_slots;
+	}
+	constexpr bool keyword_hash_is_perfect() {
+		std::array<bool, keyword_slots> used {};
+		for (auto k : keywords) {
+			if (used[keyword_hash(k.text)])
+				return false;
+			used[keyword_hash(k.text)] = true;
+		}
+		return true;
+	}
+	static_assert(keyword_hash_is_perfect(), "keyword_hash has collisions, change its factors");
+	constexpr std::array<keyword, keyword_slots> make_keyword_table() {
+		std::array<keyword, keyword_slots> table {};
+		for (auto k : keywords)
+			table[keyword_hash(k.text)] = k;
+		return table;
+	}
+	constexpr auto keyword_table = make_keyword_table();
+
+	inline enum token::type classify(std::string_view id) {
+		const keyword &k = keyword_table[keyword_hash(id)];
+		return k.text == id ? k.type : token::identifier;
+	}
+
+	// length of the floating point literal at p (see the two floating rules in lexer.ll), 0 if there is none
+	size_t float_length(const char *p) {
+		const char *q = p;
+		if (*q == '-')
+			++q;
+		const char *int_part = q;
+		while (is_digit(*q))
+			++q;
+		bool has_int_part = q != int_part;
+		if (*q != '.')
+			return 0;
+		const char *frac_part = ++q;
+		while (is_digit(*q))
+			++q;
+		if (!has_int_part && q == frac_part)
+			return 0;
+		if (*q == 'e') {
+			const char *e = q+1;
+			if (*e == '-')
+				++e;
+			if (is_digit(*e)) {
+				while (is_digit(*e))
+					++e;
+				q = e;
+			}
+		}
+		return q - p;
+	}
+}
+
+fast_lexer::fast_lexer(source &src, std::ostream &out, std::ostream &err)
+: src(src), out(out), err(err), base(src.buffer), at(src.buffer), end(src.buffer + src.size) {
+}
+
+fast_lexer::fast_lexer(source &part, const char *whole_buffer, std::ostream &out, std::ostream &err)
+: src(part), out(out), err(err), base(whole_buffer), at(part.buffer), end(part.buffer + part.size) {
+}
+
+token fast_lexer::next() {
+	if (in_attribute)
+		return attribute();
+
+	// a token of the given type and length at the current position
+	auto op = [&](enum token::type t, int len) {
+		token tok(t, std::string_view(at, len), at - base);
+		at += len;
+		return tok;
+	};
+
+	while (at < end) {
+		char c = *at;
+		uint8_t cls = char_class(c);
+
+		if (cls & alpha) {
+			const char *id_end = at+1;
+			while (is_alnum(*id_end))
+				++id_end;
+			std::string_view id(at, id_end - at);
+			if (id == "__attribute__" || id == "__asm__") {
+				const char *start = at;
+				while (is_white(*id_end))
+					++id_end;
+				at = id_end;
+				attribute_start = start;
+				attrib_nest = 0;
+				in_attribute = true;
+				return attribute();
+			}
+			return op(classify(id), id.size());
+		}
+		if (cls & digit) {
+			if (size_t n = float_length(at))
+				return op(token::floating, n);
+			const char *num_end = at;
+			while (is_digit(*num_end))
+				++num_end;
+			return op(token::integral, num_end - at);
+		}
+
+		switch (c) {
+		case ' ': case '\t': case '\r': case '\b': case '\n':
+			++at;
+			continue;
+		case '#':
+			++at;
+			preprocessor_info();
+			continue;
+		case '"':
+			return string_literal();
+		case '\'':
+			if (end - at >= 4 && at[1] == '\\' && at[2] != '\n' && at[3] == '\'') {
+				at += 4;
+				return token::make_char(std::string_view(at-4, 4), at-4 - base);
+			}
+			if (end - at >= 3 && at[1] != '\n' && at[2] == '\'') {
+				at += 3;
+				return token::make_char(std::string_view(at-3, 3), at-3 - base);
+			}
+			break;
+		case '/':
+			if (at[1] == '/') {
+				// the line break is left for the loop
+				const char *nl = (const char*)memchr(at, '\n', end - at);
+				at = nl ? nl : end;
+				continue;
+			}
+			if (at[1] == '*') {
+				at += 2;
+				block_comment();
+				continue;
+			}
+			if (at[1] == '=') return op(token::slash_equals, 2);
+			return op(token::slash, 1);
+		case '-':
+			if (size_t n = float_length(at))
+				return op(token::floating, n);
+			if (at[1] == '=') return op(token::minus_equals, 2);
+			if (at[1] == '-') return op(token::minus_minus, 2);
+			if (at[1] == '>') return op(token::arrow, 2);
+			return op(token::minus, 1);
+		case '.':
+			if (size_t n = float_length(at))
+				return op(token::floating, n);
+			if (at[1] == '.' && at[2] == '.') return op(token::ellipsis, 3);
+			return op(token::dot, 1);
+		case '<':
+			if (at[1] == '<') return at[2] == '=' ? op(token::left_left_equals, 3) : op(token::left_left, 2);
+			if (at[1] == '=') return op(token::left_equal, 2);
+			return op(token::left, 1);
+		case '>':
+			if (at[1] == '>') return at[2] == '=' ? op(token::right_right_equals, 3) : op(token::right_right, 2);
+			if (at[1] == '=') return op(token::right_equal, 2);
+			return op(token::right, 1);
+		case '*':
+			if (at[1] == '=') return op(token::star_equals, 2);
+			return op(token::star, 1);
+		case '%':
+			if (at[1] == '=') return op(token::percent_equals, 2);
+			return op(token::percent, 1);
+		case '+':
+			if (at[1] == '=') return op(token::plus_equals, 2);
+			if (at[1] == '+') return op(token::plus_plus, 2);
+			return op(token::plus, 1);
+		case '&':
+			if (at[1] == '=') return op(token::amp_equals, 2);
+			if (at[1] == '&') return op(token::amp_amp, 2);
+			return op(token::ampersand, 1);
+		case '|':
+			if (at[1] == '=') return op(token::pipe_equals, 2);
+			if (at[1] == '|') return op(token::pipe_pipe, 2);
+			return op(token::pipe, 1);
+		case '^':
+			if (at[1] == '=') return op(token::hat_equals, 2);
+			return op(token::hat, 1);
+		case '=':
+			if (at[1] == '=') return op(token::equal_equal, 2);
+			return op(token::equals, 1);
+		case '!':
+			if (at[1] == '=') return op(token::exclamation_equal, 2);
+			return op(token::exclamation, 1);
+		case '(': return op(token::paren_l, 1);
+		case ')': return op(token::paren_r, 1);
+		case '[': return op(token::bracket_l, 1);
+		case ']': return op(token::bracket_r, 1);
+		case '{': return op(token::brace_l, 1);
+		case '}': return op(token::brace_r, 1);
+		case ',': return op(token::comma, 1);
+		case ';': return op(token::semicolon, 1);
+		case ':': return op(token::colon, 1);
+		case '?': return op(token::question, 1);
+		case '~': return op(token::tilde, 1);
+		}
+		err << "unmatched char: " << (int)c << "[" << c << "]" << std::endl;
+		++at;
+	}
+	return end_of_input();
+}
+
+token fast_lexer::end_of_input() {
+	// flex reports the terminating NUL as text of the eof token
+	return token(token::eof, std::string_view(end, 1), end - base);
+}
+
+// the ATTRIB state, we return at each ')', even if it does not close the block
+token fast_lexer::attribute() {
+	while (at < end) {
+		if (*at == '(') {
+			++attrib_nest;
+			++at;
+		}
+		else if (*at == ')') {
+			++at;
+			if (--attrib_nest == 0)
+				in_attribute = false;
+			return token::make_attribute(std::string_view(attribute_start, at - attribute_start), attribute_start - base);
+		}
+		else {
+			at = scan::find_first_of<'(', ')'>(at, end);
+		}
+	}
+	unfinished = true;
+	return end_of_input();
+}
+
+// the STRING state, at is on the opening quote
+token fast_lexer::string_literal() {
+	const char *start = ++at;
+	std::string decoded;
+	bool escaped = false;
+	while (true) {
+		const char *run = at;
+		at = scan::find_first_of<'"', '\\', '\n'>(at, end);
+		if (escaped)
+			decoded.append(run, at);
+		if (at == end) {
+			unfinished = true;
+			return end_of_input();
+		}
+		char c = *at;
+		if (c == '"') {
+			std::string_view text = escaped ? src.keep(std::move(decoded)) : std::string_view(start, at - start);
+			++at;
+			return token::make_string(text, start - base);
+		}
+		if (c == '\n') {
+			std::string_view text = escaped ? std::string_view(decoded) : std::string_view(start, at - start);
+			throw lexer_error(at - base, text, "strings may not contain newlines.");
+		}
+		if (c == '\\') {
+			if (!escaped) {
+				decoded.assign(start, at);
+				escaped = true;
+			}
+			switch (at[1]) {
+			case '"': decoded += '"';  at += 2; break;
+			case 'n': decoded += '\n'; at += 2; break;
+			case 't': decoded += '\t'; at += 2; break;
+			case 'r': decoded += '\r'; at += 2; break;
+			default:  at += 1; // unknown escapes lose their backslash
+			}
+		}
+	}
+}
+
+// the COMMENT state, at is behind the opening '/' '*'
+void fast_lexer::block_comment() {
+	const char *close = at;
+	while (true) {
+		close = scan::find_first_of<'/'>(close, end);
+		if (close == end || (close > at && close[-1] == '*'))
+			break;
+		++close;
+	}
+	if (close == end)
+		unfinished = true;
+	at = close == end ? end : close+1;
+}
+
+// the PP_INFO, PP_FILE and PP_REST states, at is behind the '#'
+void fast_lexer::preprocessor_info() {
+	// {WHITE_SPACE}+{DIGIT}+{WHITE_SPACE}+\"
+	int64_t marker_line = 0;
+	while (true) {
+		if (at >= end) {
+			unfinished = true;
+			return;
+		}
+		const char *q = at;
+		while (is_white(*q))
+			++q;
+		bool found = q != at;
+		const char *digits = q;
+		while (is_digit(*q))
+			++q;
+		found = found && q != digits;
+		const char *white = q;
+		while (is_white(*q))
+			++q;
+		if (found && q != white && *q == '"') {
+			marker_line = strtoll(at, nullptr, 10);
+			at = q+1;
+			break;
+		}
+		// flex passes yytext on as a C string here, a NUL reads as empty
+		if (*at != '\n')
+			throw lexer_error(at - base, std::string_view(at, *at ? 1 : 0), "Unmatched character on preprocessor line information");
+		out << '\n'; // flex's default rule echoes what no rule matches
+		++at;
+	}
+
+	// [^"]* is the file name
+	const char *name = at;
+	while (at < end && *at != '"')
+		++at;
+	if (at != name)
+		marker_file = src.files.intern(std::string_view(name, at - name));
+	if (at >= end) {
+		unfinished = true;
+		return;
+	}
+	++at;
+
+	// flags up to the end of the line
+	while (at < end) {
+		char c = *at;
+		if (c == '\n') {
+			++at;
+			src.lines.mark(at - base, marker_file, marker_line);
+			return;
+		}
+		if ((c >= '1' && c <= '4') || c == ' ' || c == '\t')
+			++at;
+		else {
+			err << "Unrecognized cpp character '" << std::string_view(at, c ? 1 : 0) << "'" << std::endl;
+			++at;
+		}
+	}
+	unfinished = true;
+}
@@ -0,0 +1,93 @@
+#include "incremental-parser.h"
+#include "tree.h"
+
+#include <algorithm>
+#include <set>
+
+using namespace ast;
+
+namespace {
+	bool same_token(token a, token b, int64_t shift) {
+		return a.type == b.type && a.offset + shift == b.offset && a.text == b.text;
+	}
+}
+
+pointer_to<ast::translation_unit> incremental_parser::parse(std::unique_ptr<source> &&src) {
+	token_array all = lex_input(*src, backend);
+	auto next = std::make_shared<version>(std::move(src), std::move(all));
+	p.reset(next->tokens);
+	next->memory = p.memory = std::make_shared<arena>();
+	arena::use in(*next->memory);
+	reused = reparsed = 0;
+
+	std::vector<entry> now;
+	size_t k = 0, suffix = 0;
+	int64_t shift = 0;
+	bool compare = latest && clean;
+	if (compare) {
+		size_t n = std::min(latest->size, next->size), prefix = 0;
+		while (prefix < n && same_token((*latest->tokens)[prefix], (*next->tokens)[prefix], 0))
+			++prefix;
+		int64_t byte_shift = int64_t(next->src->size) - int64_t(latest->src->size);
+		while (suffix < n - prefix && same_token((*latest->tokens)[latest->size-1 - suffix], (*next->tokens)[next->size-1 - suffix], byte_shift))
+			++suffix;
+		shift = int64_t(next->size) - int64_t(latest->size);
+
+		// declarations before the change stay, their typedefs are needed for what follows
+		for (; k < entries.size() && entries[k].end <= prefix; ++k) {
+			for (auto &name : entries[k].typedefs)
+				p.register_type(name);
+			now.push_back(entries[k]);
+			reused++;
+		}
+		p.current = k ? entries[k-1].end : 0;
+	}
+
+	std::set<std::string> old_typedefs, new_typedefs;	// of the declarations that are replaced and those replacing them
+	size_t j = k;
+	try {
+		while (!p.at_end()) {
+			if (compare && p.errors.empty() && p.current >= next->size - suffix) {
+				size_t old_pos = p.current - shift;
+				for (; j < entries.size() && entries[j].first < old_pos; ++j)
+					old_typedefs.insert(entries[j].typedefs.begin(), entries[j].typedefs.end());
+				if (j < entries.size() && entries[j].first == old_pos && old_typedefs == new_typedefs) {
+					for (; j < entries.size(); ++j) {
+						now.push_back(entries[j]);
+						now.back().first += shift;
+						now.back().end += shift;
+						reused++;
+					}
+					break;
+				}
+			}
+			size_t first = p.current, defined_before = p.defined.size();
+			auto decl = p.toplevel_declaration();
+			if (!decl)
+				continue;
+			entry e { next, first, p.current, decl, {} };
+			for (size_t i = defined_before; i < p.defined.size(); ++i)
+				e.typedefs.emplace_back(p.names[p.defined[i]]);
+			new_typedefs.insert(e.typedefs.begin(), e.typedefs.end());
+			now.push_back(std::move(e));
+			reparsed++;
+		}
+	}
+	catch (parser::gave_up) {
+	}
+
+	// taken-over nodes refer to the tokens of their own version
+	auto root = p.new_root();
+	for (auto &e : now) {
+		auto stream = std::find(root->streams.begin(), root->streams.end(), e.origin->tokens);
+		if (stream == root->streams.end()) {
+			stream = root->streams.insert(stream, e.origin->tokens);
+			root->memory.push_back(e.origin->memory);
+		}
+		root->add(e.node, stream - root->streams.begin());
+	}
+	clean = p.errors.empty();
+	entries = std::move(now);
+	latest = next;
+	return root;
+}
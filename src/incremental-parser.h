@@ -0,0 +1,47 @@
+#pragma once
+
+#include "parser.h"
+#include "source.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Parses successive versions of one input, e.g. as an editor saves it.
+ * The tokens of a new version are compared to those of the previous one. Top-level declarations made up only of
+ * tokens before the first difference are taken over as they are. Parsing starts at the first declaration that
+ * changed and stops as soon as it is back at the start of an old declaration within the unchanged tail, provided
+ * the declarations parsed meanwhile leave the same typedef names behind. Everything from there on is taken over too.
+ * Taken-over nodes still point into the version they were parsed from, which is kept for as long as they are used.
+ */
+class incremental_parser {
+	struct version {
+		std::unique_ptr<source> src;
+		size_t size;	// tokens, including eof
+		std::shared_ptr<token_stream> tokens;
+		std::shared_ptr<arena> memory;	// of the nodes parsed from it
+		version(std::unique_ptr<source> src, token_array &&all)
+		: src(std::move(src)), size(all.size()), tokens(std::make_shared<token_stream>(std::move(all))) {}
+	};
+	struct entry {
+		std::shared_ptr<version> origin;
+		size_t first, end;	// token range in the latest version
+		ast::pointer_to<ast::declaration> node;
+		std::vector<std::string> typedefs;	// names that it makes types at file scope
+	};
+	lexer::backend backend;
+	parser p;
+	std::shared_ptr<version> latest;
+	std::vector<entry> entries;
+	bool clean = false;	// the latest version parsed without errors, so entries cover all of it
+public:
+	size_t reused = 0, reparsed = 0;	// top-level declarations, in the last call to parse
+
+	incremental_parser(lexer::backend backend = lexer::flex, size_t max_errors = 20, size_t max_depth = parser::default_max_depth)
+	: backend(backend), p(max_errors, max_depth) {}
+	// src is only taken over once it has been lexed, after a lexer_error it is still the caller's
+	ast::pointer_to<ast::translation_unit> parse(std::unique_ptr<source> &&src);
+	const std::vector<parse_error>& errors() const { return p.errors; }
+	bool gave_up_early() const { return p.gave_up_early; }
+	const source& latest_source() const { return *latest->src; }
+};
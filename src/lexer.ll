@@ -1,11 +1,13 @@
 %{
 
-#include "token.h"
+#include "source.h"
+#include "token-cache.h"
 
 #include <iostream>
+#include <sstream>
 using std::cout, std::endl;
 
-#define YY_DECL token yylex(void)
+#define YY_DECL token yylex(yyscan_t yyscanner)
 
 //#define LEX_DEBUG_OUT
 #ifdef LEX_DEBUG_OUT
@@ -14,31 +16,59 @@ using std::cout, std::endl;
 #define OUT(X)
 #endif
 
-std::string lexer_current_filename;
-static int col = 0;
-static int last_line = 0;
-
-#define YY_USER_ACTION \
-  /* printf("matched token '%s' of len %d [state %d]\n", yytext, yyleng, yy_start); */ \
-  if (last_line != yylineno) \
-    last_line = yylineno, col = yyleng; \
-  else \
-    col += yyleng;
-
-#define matched(X) return token(token::X, yytext, yylineno, col-yyleng, lexer_current_filename)
-
-std::string string_accum = "";
-int string_accum_start = 0;
-
-std::string attribute_accum;
-int attribute_accum_col_start = 0;
-int attribute_accum_line_start = 0;
-int attrib_nest = 0;
+/* Everything the scanner keeps between two tokens.
+ * Each lexer owns one of these and hands it to its flex instance as yyextra.
+ */
+struct flex_lexer::state {
+	yyscan_t scanner = nullptr;
+	source &src;
+	std::ostream &out, &err;	// what the default rule echoes and the warnings
+	// linemarker being read, it takes effect on the following line
+	int64_t marker_line = 0;
+	int marker_file = 0;
+
+	// flex keeps buffer sizes in ints, so large inputs are scanned in windows, see next_window
+	YY_BUFFER_STATE window = nullptr;
+	char *window_end = nullptr;
+	char window_saved[2];
+
+	// string literals are views into the source unless they contain escapes, then we decode them to string_accum
+	const char *string_start = nullptr;
+	bool string_escaped = false;
+	std::string string_accum;
+
+	// attributes are taken verbatim, so we only have to remember where they begin
+	const char *attribute_start = nullptr;
+	int attrib_nest = 0;
+
+	state(source &src, std::ostream &out, std::ostream &err) : src(src), out(out), err(err), window_end(src.buffer) {}
+	bool next_window();
+	int64_t offset(const char *at) const { return at - src.buffer; }
+	void string_decode(const char *at) {
+		if (!string_escaped) {
+			string_accum.assign(string_start, at);
+			string_escaped = true;
+		}
+	}
+	std::string_view string_text(const char *end) {
+		if (string_escaped)
+			return src.keep(std::move(string_accum));
+		return std::string_view(string_start, end - string_start);
+	}
+};
+
+static constexpr size_t max_window = size_t(1) << 30;
+
+#define ECHO yyextra->out.write(yytext, yyleng)
+
+// windows scan the source buffer in place, so yytext is where the match is in the input
+#define matched(X) return token(token::X, std::string_view(yytext, yyleng), yyextra->offset(yytext))
 
 %}
 
 %option noyywrap
-%option yylineno
+%option reentrant
+%option extra-type="flex_lexer::state *"
 
 WHITE_SPACE [\n\r\ \t\b\012]
 DIGIT [0-9]
@@ -55,7 +85,7 @@ ALNUM ({DIGIT}|{ALPHA})
 
 %%
 
-<<EOF>>										matched(eof);
+<<EOF>>										{ if (!yyextra->next_window()) matched(eof); }
 
 <INITIAL>"\#"  { BEGIN(PP_INFO); }
 
@@ -156,44 +186,47 @@ ALNUM ({DIGIT}|{ALPHA})
 <INITIAL>"for" matched(kw_for);
 <INITIAL>"goto" matched(kw_goto);
 
-<INITIAL>"'"."'" return token::make_char(yytext, yylineno, col-yyleng, lexer_current_filename);
-<INITIAL>"'\\"."'" return token::make_char(yytext, yylineno, col-yyleng, lexer_current_filename);
+<INITIAL>"'"."'" return token::make_char(std::string_view(yytext, yyleng), yyextra->offset(yytext));
+<INITIAL>"'\\"."'" return token::make_char(std::string_view(yytext, yyleng), yyextra->offset(yytext));
 
-<INITIAL>\" { string_accum = ""; string_accum_start = col; BEGIN(STRING); }
-<INITIAL>__attribute__{WHITE_SPACE}*  { attribute_accum = yytext; attribute_accum_col_start = col; attribute_accum_line_start = yylineno; attrib_nest = 0; BEGIN(ATTRIB); }
-<INITIAL>__asm__{WHITE_SPACE}*  { attribute_accum = yytext; attribute_accum_col_start = col; attribute_accum_line_start = yylineno; attrib_nest = 0; BEGIN(ATTRIB); }
+<INITIAL>\" { yyextra->string_start = yytext+1; yyextra->string_escaped = false; BEGIN(STRING); }
+<INITIAL>__attribute__{WHITE_SPACE}*  { yyextra->attribute_start = yytext; yyextra->attrib_nest = 0; BEGIN(ATTRIB); }
+<INITIAL>__asm__{WHITE_SPACE}*  { yyextra->attribute_start = yytext; yyextra->attrib_nest = 0; BEGIN(ATTRIB); }
 
 <INITIAL>{ALPHA}{ALNUM}*        matched(identifier);
 
-<INITIAL>.									{ 	std::cerr << "unmatched char: " << (int)yytext[0] << "[" << yytext[0] << "]" << endl; }
+<INITIAL>.									{ 	yyextra->err << "unmatched char: " << (int)yytext[0] << "[" << yytext[0] << "]" << endl; }
 
 <LINE_COMMENT>\n							BEGIN(INITIAL);
 <LINE_COMMENT>.*							{	OUT("line comment: " << yytext); }
 
 <COMMENT>"*/"       BEGIN(INITIAL);
-<COMMENT>.*         { OUT("comment: " << yytext); }
-
-<STRING>\\\" string_accum += '"';
-<STRING>\\n string_accum += '\n';
-<STRING>\\t string_accum += '\t';
-<STRING>\\r string_accum += '\r';
-<STRING>\" { BEGIN(INITIAL); return token::make_string(string_accum, yylineno, string_accum_start, lexer_current_filename); }
-<STRING>[^\n"\\] string_accum += yytext;
-<STRING>\n throw lexer_error(yylineno, col-yyleng, string_accum, "strings may not contain newlines.");
-
-<PP_INFO>{WHITE_SPACE}+{DIGIT}+{WHITE_SPACE}+\"     { yylineno=atoi(yytext)-1; /* cout << "LINE is now " << yylineno << endl; */ BEGIN(PP_FILE); }
-<PP_FILE>[^"]*                                      { /* cout << "PP-\"m: '" << yytext << "'" << endl; */ lexer_current_filename = yytext; }
+<COMMENT>[^*\n]+    { OUT("comment: " << yytext); }
+<COMMENT>"*"        /* not followed by '/' */
+<COMMENT>\n         /*ignore*/
+
+<STRING>\\\" yyextra->string_decode(yytext); yyextra->string_accum += '"';
+<STRING>\\n yyextra->string_decode(yytext); yyextra->string_accum += '\n';
+<STRING>\\t yyextra->string_decode(yytext); yyextra->string_accum += '\t';
+<STRING>\\r yyextra->string_decode(yytext); yyextra->string_accum += '\r';
+<STRING>\\  yyextra->string_decode(yytext); /* unknown escapes lose their backslash */
+<STRING>\" { BEGIN(INITIAL); return token::make_string(yyextra->string_text(yytext), yyextra->offset(yyextra->string_start)); }
+<STRING>[^\n"\\]+ if (yyextra->string_escaped) yyextra->string_accum.append(yytext, yyleng);
+<STRING>\n throw lexer_error(yyextra->offset(yytext), yyextra->string_text(yytext), "strings may not contain newlines.");
+
+<PP_INFO>{WHITE_SPACE}+{DIGIT}+{WHITE_SPACE}+\"     { yyextra->marker_line = strtoll(yytext, nullptr, 10); BEGIN(PP_FILE); }
+<PP_FILE>[^"]*                                      { /* cout << "PP-\"m: '" << yytext << "'" << endl; */ yyextra->marker_file = yyextra->src.files.intern(std::string_view(yytext, yyleng)); }
 <PP_FILE>\"                                         { /* cout << "PP-\"m: '" << yytext << "'" << endl; */ BEGIN(PP_REST); }
 <PP_REST>[1234 \t]+	                                { /* cout << "PP-suffix: '" << yytext << "'" << endl; */ }
-<PP_REST>\n							                { /* cout << "--> PP-done" << endl; */ BEGIN(INITIAL); }
+<PP_REST>\n							                { yyextra->src.lines.mark(yyextra->offset(yytext+1), yyextra->marker_file, yyextra->marker_line); BEGIN(INITIAL); }
 
-<PP_INFO>.	                                        { throw lexer_error(yylineno, col-yyleng, yytext, "Unmatched character on preprocessor line information"); }
-<PP_REST>.	                                        { std::cerr << "Unrecognized cpp character '" << yytext << "'" << endl; }
+<PP_INFO>.	                                        { throw lexer_error(yyextra->offset(yytext), yytext, "Unmatched character on preprocessor line information"); }
+<PP_REST>.	                                        { yyextra->err << "Unrecognized cpp character '" << yytext << "'" << endl; }
 
-<ATTRIB>"("                  { attribute_accum+="("; attrib_nest++; }
-<ATTRIB>")"                  { attribute_accum+=")"; attrib_nest--; if (attrib_nest==0) BEGIN(INITIAL);
-                               return token::make_attribute(attribute_accum, attribute_accum_line_start, attribute_accum_col_start, lexer_current_filename); }
-<ATTRIB>[^()]+               { attribute_accum+=yytext; }
+<ATTRIB>"("                  { yyextra->attrib_nest++; }
+<ATTRIB>")"                  { yyextra->attrib_nest--; if (yyextra->attrib_nest==0) BEGIN(INITIAL);
+                               return token::make_attribute(std::string_view(yyextra->attribute_start, yytext+yyleng - yyextra->attribute_start), yyextra->offset(yyextra->attribute_start)); }
+<ATTRIB>[^()]+               { }
 
 %%
 
@@ -202,18 +235,84 @@ ALNUM ({DIGIT}|{ALPHA})
 #include <vector>
 #include <stdio.h>
 
+/* Start scanning the next (at most max_window) bytes of the source in place.
+ * A window ends on a line break, i.e. outside of any token, and the two NULs flex requires there are written over
+ * the input. They are restored when moving on to the next window.
+ */
+bool flex_lexer::state::next_window() {
+  char *from = window_end;
+  char *input_end = src.buffer + src.size;
+  if (window && from == input_end)
+    return false;
+  char *end = input_end;
+  if (size_t(end - from) > max_window) {
+    char *half = from + max_window/2;
+    end = from + max_window;
+    while (end > half && end[-1] != '\n')
+      --end;
+    if (end == half)
+      end = from + max_window;
+  }
+  // the old buffer has to go first, switching away from it would store flex's hold char over the restored input
+  if (window) {
+    yy_delete_buffer(window, scanner);
+    window_end[0] = window_saved[0];
+    window_end[1] = window_saved[1];
+  }
+  window_saved[0] = end[0];
+  window_saved[1] = end[1];
+  end[0] = end[1] = '\0';
+  window = yy_scan_buffer(from, end - from + 2, scanner);
+  window_end = end;
+  return true;
+}
 
-std::vector<token> lex_input(const std::string &filename) {
-  lexer_current_filename = filename;
-  std::vector<token> tokens;
-  yyin = fopen(filename.c_str(), "r");
+flex_lexer::flex_lexer(source &src, std::ostream &out, std::ostream &err) : st(std::make_unique<state>(src, out, err)) {
+  yylex_init_extra(st.get(), &st->scanner);
+  st->next_window();
+}
 
-  while (true) {
-    token t = yylex();
-    tokens.push_back(t);
-    if (t.type == token::eof)
-      return tokens;
+flex_lexer::~flex_lexer() {
+  // leave the source as we found it, even if lexing was aborted
+  st->window_end[0] = st->window_saved[0];
+  st->window_end[1] = st->window_saved[1];
+  yylex_destroy(st->scanner);
+}
+
+token flex_lexer::next() {
+  return yylex(st->scanner);
+}
+
+// with a cache, what the lexer prints is held back and kept with the tokens, so that a hit prints it again
+token_array lex_input(source &src, lexer::backend kind, token_cache *cache) {
+  token_array tokens(src);
+  std::string printed_out, printed_err;
+  if (cache && cache->load(src, tokens, printed_out, printed_err)) {
+    std::cout << printed_out;
+    std::cerr << printed_err;
+    return tokens;
   }
+  std::ostringstream out, err;
+  auto lex = cache ? lexer::make(src, kind, out, err) : lexer::make(src, kind);
+  auto pass_on = [&]() {
+    std::cout << out.str();
+    std::cerr << err.str();
+  };
+  try {
+    if (!lex->take_all(tokens))
+      while (true) {
+        token t = lex->next();
+        tokens.push_back(t);
+        if (t.type == token::eof)
+          break;
+      }
+  }
+  catch (...) {
+    pass_on();
+    throw;
+  }
+  pass_on();
+  if (cache)
+    cache->store(src, tokens, out.str(), err.str());
   return tokens;
 }
-
@@ -1,29 +1,132 @@
 #include "token.h"
+#include "source.h"
 #include "parser.h"
+#include "tree.h"
+#include "token-cache.h"
+#include "incremental-parser.h"
 
+#include <charconv>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
 
 using std::cout, std::endl, std::cerr;
 
+static int usage(const char *self) {
+	cerr << "usage: " << self << " [--lexer=flex|fast|parallel] [--parser=sequential|parallel] [--tokens] [--token-cache=DIR] [--dump-ast|--quiet|--validate] [--max-errors=N] [--max-depth=N] [--ast-memory] [--reparse=EDITED] file" << endl;
+	return -1;
+}
+
+// all of text is a number >= 0
+static bool parse_count(std::string_view text, size_t &value) {
+	auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+	return !text.empty() && ec == std::errc() && end == text.data() + text.size();
+}
+
 int main(int argc, char **argv) {
-	if (argc != 2) {
-		cerr << "Args!" << endl;
-		return -1;
+	const char *filename = nullptr;
+	lexer::backend backend = lexer::flex;
+	bool dump_tokens = false;
+	// dump-ast prints the tree, quiet only reports errors, validate only sets the exit code
+	enum { dump_ast, quiet, validate } mode = dump_ast;
+	size_t max_errors = 20;
+	size_t max_depth = parser::default_max_depth;
+	const char *edited = nullptr;
+	bool parallel_parse = false;
+	bool memory_stats = false;
+	std::unique_ptr<token_cache> cache;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--lexer=flex")      backend = lexer::flex;
+		else if (arg == "--lexer=fast") backend = lexer::fast;
+		else if (arg == "--lexer=parallel") backend = lexer::parallel;
+		else if (arg == "--tokens")     dump_tokens = true;
+		else if (arg == "--dump-ast")   mode = dump_ast;
+		else if (arg == "--quiet")      mode = quiet;
+		else if (arg == "--validate")   mode = validate;
+		else if (arg == "--parser=sequential") parallel_parse = false;
+		else if (arg == "--parser=parallel")   parallel_parse = true;
+		else if (arg == "--ast-memory")        memory_stats = true;
+		else if (arg.starts_with("--reparse=")) edited = argv[i] + 10;
+		else if (arg.starts_with("--max-errors=")) {
+			if (!parse_count(argv[i] + 13, max_errors))
+				return usage(argv[0]);
+		}
+		else if (arg.starts_with("--max-depth=")) {
+			if (!parse_count(argv[i] + 12, max_depth))
+				return usage(argv[0]);
+		}
+		else if (arg.starts_with("--token-cache=")) cache = std::make_unique<token_cache>(arg.substr(14));
+		else if (arg[0] != '-' && !filename) filename = argv[i];
+		else return usage(argv[0]);
 	}
+	if (!filename)
+		return usage(argv[0]);
+
+	// with a cache the tokens have to be complete before parsing, so that they can be stored
+	auto lex_all = [&](source &src) {
+		token_array all = lex_input(src, backend, cache.get());
+		if (mode != validate)
+			cerr << "token cache: " << cache->hits << " hits, " << cache->misses << " misses, " << cache->rejected << " rejected" << endl;
+		return all;
+	};
+
+	// reports the errors or prints the tree, gives the exit code
+	auto finish = [&](ast::pointer_to<ast::translation_unit> root, const std::vector<parse_error> &errors, bool gave_up_early, const source &src) {
+		if (!errors.empty()) {
+			if (mode != validate) {
+				for (auto &e : errors)
+					cerr << e.report(src) << endl;
+				if (gave_up_early)
+					cerr << "Too many errors, giving up." << endl;
+			}
+			return -1;
+		}
+		if (mode == dump_ast)
+			ast::print(root);
+		if (memory_stats) {
+			size_t used = 0, reserved = 0, blocks = 0;
+			for (auto &a : root->memory) {
+				used += a->used();
+				reserved += a->reserved();
+				blocks += a->block_count();
+			}
+			size_t nodes = 0;
+			ast::walk_tree(root, [&](ast::node *) { nodes++; }, [](ast::node *) {});
+			cerr << "ast memory: " << used << " bytes used, " << reserved << " reserved in " << blocks << " blocks, " << nodes << " nodes" << endl;
+		}
+		return 0;
+	};
+
+	std::unique_ptr<source> src;
 	try {
-		auto tokens = lex_input(argv[1]);
-// 		for (auto t : tokens) {
-// 			cout << " - " << token::type_string(t.type) << ": " << t.text << " @" << t.line << "." << t.pos << endl;
-// 			cout << " * " << t << endl;
-// 		}
-		parse(tokens);
-	}
-	catch (lexer_error e) {
-		cerr << e.what() << endl;
-		return -1;
+		src = std::make_unique<source>(filename);
+		if (dump_tokens) {
+			token_array all = cache ? lex_all(*src) : lex_input(*src, backend);
+			for (size_t i = 0; i < all.size(); ++i)
+				cout << all[i] << endl;
+			return 0;
+		}
+		if (edited) {
+			// parse the file, then its edited version the way an editor integration would
+			incremental_parser inc(backend, max_errors, max_depth);
+			delete inc.parse(std::move(src));
+			// kept here while lexing, so that a lexer_error can be reported against it
+			src = std::make_unique<source>(edited);
+			std::unique_ptr<ast::translation_unit> root(inc.parse(std::move(src)));
+			if (mode != validate)
+				cerr << "incremental: " << inc.reused << " reused, " << inc.reparsed << " reparsed" << endl;
+			return finish(root.get(), inc.errors(), inc.gave_up_early(), inc.latest_source());
+		}
+		auto tokens = cache ? std::make_shared<token_stream>(lex_all(*src)) : std::make_shared<token_stream>(*src, backend);
+		parser p(max_errors, max_depth);
+		std::unique_ptr<ast::translation_unit> root(parallel_parse ? p.parse_parallel(tokens) : p.parse(tokens));
+		return finish(root.get(), p.errors, p.gave_up_early, *src);
 	}
-	catch (parse_error e) {
-		cerr << e.what() << endl;
+	catch (const lexer_error &e) {
+		if (mode != validate)
+			cerr << (src ? e.report(*src) : e.what()) << endl;
 		return -1;
 	}
 	return 0;
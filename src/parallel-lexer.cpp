@@ -0,0 +1,119 @@
+#include "token.h"
+#include "source.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <cctype>
+#include <cstring>
+
+namespace {
+	constexpr size_t parts_per_thread = 4;
+
+	unsigned threads() {
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	// a line that cpp starts with '# N "file"', after it nothing depends on what came before
+	bool starts_linemarker(const char *p, const char *end) {
+		if (end - p < 6 || p[0] != '#' || p[1] != ' ' || !isdigit((unsigned char)p[2]))
+			return false;
+		p += 2;
+		while (p < end && isdigit((unsigned char)*p))
+			++p;
+		return end - p >= 3 && p[0] == ' ' && p[1] == '"' && p[2] != '"';
+	}
+
+	// offsets at which the input is cut, starting with 0 and ending with its size
+	std::vector<size_t> split(const source &src, size_t min_part_size) {
+		const char *begin = src.buffer, *end = src.buffer + src.size;
+		size_t parts = std::max(size_t(1), std::min(threads() * parts_per_thread, src.size / std::max(min_part_size, size_t(1))));
+		std::vector<size_t> cuts { 0 };
+		for (size_t i = 1; i < parts; ++i) {
+			const char *p = begin + std::max(cuts.back() + 1, src.size / parts * i);
+			while (p < end) {
+				const char *nl = (const char*)memchr(p, '\n', end - p);
+				if (!nl)
+					break;
+				p = nl + 1;
+				if (starts_linemarker(p, end)) {
+					cuts.push_back(p - begin);
+					break;
+				}
+			}
+		}
+		cuts.push_back(src.size);
+		return cuts;
+	}
+
+	struct part {
+		std::unique_ptr<source> src;
+		std::vector<token> tokens;
+		std::exception_ptr error;
+		bool clean = false;
+		std::ostringstream out, err;	// held back until we know the part is valid
+	};
+
+	part lex_part(const source &whole, size_t from, size_t to) {
+		part p;
+		p.src = std::make_unique<source>(whole, from, to);
+		fast_lexer lex(*p.src, whole.buffer, p.out, p.err);
+		try {
+			do
+				p.tokens.push_back(lex.next());
+			while (p.tokens.back().type != token::eof);
+			p.clean = lex.ended_between_tokens();
+		}
+		catch (...) {
+			p.error = std::current_exception();
+		}
+		return p;
+	}
+}
+
+bool parallel_lexer::worthwhile(const source &src) {
+	return threads() > 1 && src.size >= size_t(16) << 20;
+}
+
+parallel_lexer::parallel_lexer(source &src, std::ostream &out, std::ostream &err, size_t min_part_size) : tokens(src) {
+	std::vector<size_t> cuts = split(src, min_part_size);
+	std::vector<part> parts(cuts.size() - 1);
+	std::atomic<size_t> next_part = 0;
+	auto work = [&]() {
+		for (size_t i = next_part++; i < parts.size(); i = next_part++)
+			parts[i] = lex_part(src, cuts[i], cuts[i+1]);
+	};
+	std::vector<std::thread> pool;
+	for (unsigned i = 1; i < std::min(threads(), unsigned(parts.size())); ++i)
+		pool.emplace_back(work);
+	work();
+	for (auto &t : pool)
+		t.join();
+
+	// join the parts in order, each one is only valid if its predecessor ended cleanly
+	for (size_t i = 0; i < parts.size(); ++i) {
+		while (!parts[i].clean && !parts[i].error && i+1 < parts.size()) {
+			cuts.erase(cuts.begin() + i+1);
+			parts.erase(parts.begin() + i+1);
+			parts[i] = lex_part(src, cuts[i], cuts[i+1]);
+		}
+		part &p = parts[i];
+		out << p.out.str();
+		err << p.err.str();
+		std::vector<int> file_ids;
+		for (auto name : p.src->files.names)
+			file_ids.push_back(src.files.intern(name));
+		src.lines.append(p.src->lines, file_ids);
+		src.decoded.splice(src.decoded.end(), p.src->decoded);
+		if (p.error)
+			std::rethrow_exception(p.error);
+
+		bool last = i+1 == parts.size();
+		for (const token &t : p.tokens)
+			if (t.type != token::eof || last)
+				tokens.push_back(t);
+	}
+}
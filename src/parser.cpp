@@ -1,678 +1,1064 @@
 #include "parser.h"
+#include "source.h"
 #include "tree.h"
 
-#include <iostream>
-#include <functional>
-#include <set>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <initializer_list>
+#include <numeric>
+#include <thread>
 #include <cassert>
+#include <sys/resource.h>
 
 using namespace std;
 using namespace ast;
 
-#define helper(X,...) auto X = [&](__VA_ARGS__)
-#define rule(X) auto X = [&]()
-#define prule(X,P) auto X = [&](P)
-#define frule(X) X = [&]()
-#define pfrule(X,P) X = [&](P)
-#define rrule(X,Y) std::function<pointer_to<ast::Y>()> X = [&]() -> pointer_to<ast::Y>
-#define prrule(X,P,Y) std::function<pointer_to<ast::Y>(P)> X = [&](P) -> pointer_to<ast::Y>
-#define fprrule(X,P,Y) X = [&](P) -> pointer_to<ast::Y>
+std::string parse_error::report(const source &src) const {
+	auto loc = src.locate(at);
+	std::ostringstream oss;
+	oss << "Parse Error: " << message << " @" << loc.file << ":" << loc.line << ":" << loc.col << ", got token '" << src.describe(at) << "'";
+	return oss.str();
+}
 
-static constexpr bool verbose = true;
-#define log if (verbose) cout
+/* 
+ * Symbol table.
+ *
+ */
 
-struct scope {
-	token scope_head;
-	std::set<std::string> typenames;
-	scope(token head) : scope_head(head) {}
-	void define(token t) {
-		typenames.insert(t.text);
-	}
-	bool defined(const std::string &name) {
-		return typenames.contains(name);
+uint32_t parser::intern(std::string_view name) {
+	auto [it, added] = identifiers.try_emplace(name, identifiers.size());
+	if (added) {
+		names.push_back(name);
+		type_depth.push_back(0);
 	}
-};
+	return it->second;
+}
+void parser::push_scope() {
+	scope_marks.push_back(defined.size());
+}
+void parser::pop_scope() {
+	for (size_t i = scope_marks.back(); i < defined.size(); ++i)
+		type_depth[defined[i]]--;
+	defined.resize(scope_marks.back());
+	scope_marks.pop_back();
+}
+void parser::register_type(std::string_view name) {
+	uint32_t n = intern(name);
+	type_depth[n]++;
+	defined.push_back(n);
+}
+// only valid for identifier tokens
+bool parser::is_type(size_t i) {
+	if (i < ident_from)
+		return type_depth[intern(tokens->text(i))] > 0;
+	size_t k = i - ident_from;
+	if (k >= ident_at.size())
+		ident_at.resize(k+1, no_ident);
+	if (ident_at[k] == no_ident)
+		ident_at[k] = intern(tokens->text(i));
+	return type_depth[ident_at[k]] > 0;
+}
 
-void parse(const vector<token> &tokens) {
+/* 
+ * Token access.
+ *
+ */
 
-	int current = 0;
-	
-	// symbol table for lexer feedback
-	vector<scope> scopes;
-	helper(push_scope, token head) {
-		scopes.emplace_back(head);
-	};
-	helper(pop_scope) {
-		scopes.pop_back();
-	};
-	helper(register_type, token id) {
-		scopes.back().define(id);
-	};
-	helper(is_type, token t) {
-		if (t == token::identifier)
-			for (auto it = scopes.rbegin(); it != scopes.rend(); ++it)
-				if (it->defined(t.text))
-					return true;
+enum token::type parser::type_at(size_t i) {
+	enum token::type t = tokens->type(i);
+	if (t == token::identifier && is_type(i))
+		return token::type_name;
+	return t;
+}
+bool parser::at_end() {
+	return tokens->type(current) == token::eof;
+}
+token parser::token_at(size_t i) {
+	token t = (*tokens)[i];
+	t.type = type_at(i);
+	return t;
+}
+token parser::previous() {
+	assert(current > 0);
+	return token_at(current-1);
+}
+token parser::advance() {
+	if (!at_end()) current++;
+	return previous();
+}
+token parser::peek() {
+	return token_at(current);
+}
+bool parser::check(enum token::type t) {
+	if (at_end()) return false;
+	return type_at(current) == t;
+}
+bool parser::check1(enum token::type t) {
+	return type_at(current+1) == t;
+}
+token parser::consume(enum token::type type, const char *message) {
+	if (check(type)) return advance();
+	throw parse_error(peek(), message);
+}
+template<typename... Ts> bool parser::match(Ts... ts) {
+	for (enum token::type x : std::initializer_list<enum token::type>{ts...})
+		if (check(x)) {
+			advance();
+			return true;
+		}
+	return false;
+}
+bool parser::next_is_expression() {
+	switch (type_at(current)) {
+	case token::identifier:
+	case token::integral: case token::floating: case token::character: case token::string: 
+	case token::star: case token::paren_l: case token::minus: case token::minus_minus:
+		return true;
+	default:
 		return false;
-	};
-	helper(as_type, token t) {
-		return token(token::type_name, t.text, t.line, t.pos, "");
-	};
-	helper(fix_token, token t) {
-		if (is_type(t))
-			return as_type(t);
-		return t;
-	};
-	push_scope(token(token::eof, "global scope", -1, -1, ""));
-	
-	// token access
-	helper(at_end) {
-		return tokens[current] == token::eof;
-	};
-	helper(previous) {
-		assert(current > 0);
-		return fix_token(tokens[current-1]);
-	};
-	helper(advance) {
-		if (!at_end()) current++;
-		return previous();
-	};
-	helper(peek) {
-		return fix_token(tokens[current]);
-	};
-	helper(check, enum token::type t) {
-		if (at_end()) return false;
-		return peek() == t;
-	};
-	helper(consume, enum token::type type, const std::string &message) {
-		if (check(type)) return advance();
-		throw parse_error(peek(), message);
-	};
-	helper(rewind1) {
-		current--;
-	};
-	helper(match, auto... ts) {
-		using expand = enum token::type[];	// c++ is crazy...
-		for (auto x : expand{ts...})
-			if (check(x)) {
-				advance();
-				return true;
-			}
+	}
+}
+bool parser::starts_type_name() {
+	switch (type_at(current)) {
+	case token::kw_void: case token::kw_char: case token::kw_int: case token::kw_float: case token::kw_double: case token::kw_bool: case token::kw_complex:
+	case token::type_name: case token::kw_unsigned: case token::kw_signed: case token::kw_long: case token::kw_short:
+	case token::kw_const: case token::kw_volatile: case token::kw_struct: case token::kw_union: case token::kw_enum:
+		return true;
+	default:
 		return false;
-	};
-	helper(peek1) {
-		if (current < tokens.size())
-			return fix_token(tokens[current+1]);
-		return fix_token(tokens[current]); // will be eof
-	};
-	helper(check1, enum token::type t) {
-		return peek1() == t;
-	};
-	helper(log_tokens, int N) {
-		log << "tokenstream excerpt: ";
-		for (int i = 0; i < N; ++i)
-			if (current+i < tokens.size())
-				log << tokens[i];
-		log << endl;
-	};
-	
-	helper(next_is_expression) {
-		token t = peek();
-		switch (t.type) {
-		case token::identifier:
-		case token::integral: case token::floating: case token::character: case token::string: 
-		case token::star: case token::paren_l: case token::minus: case token::minus_minus:
-			return true;
+	}
+}
+
+/* 
+ * Error recovery.
+ *
+ */
+
+// skip to the end of the current statement or declaration: after the next ';' or balanced '}',
+// or up to the '}' closing the enclosing block
+void parser::synchronize() {
+	int depth = 0;
+	for (; !at_end(); ++current)
+		switch (tokens->type(current)) {
+		case token::semicolon:
+			if (depth == 0) {
+				++current;
+				return;
+			}
+			break;
+		case token::brace_l:
+			++depth;
+			break;
+		case token::brace_r:
+			if (depth == 0)
+				return;
+			if (--depth == 0) {
+				++current;
+				return;
+			}
+			break;
 		default:
-			return false;
+			break;
 		}
-	};
+}
 
-	std::function<pointer_to<ast::expression>()> expression;
-	std::function<pointer_to<ast::expression>()> cast_exp;
-	std::function<pointer_to<ast::expression>()> assignment_exp;
+// the construct starting at 'start' failed with e, note it and carry on behind it
+void parser::recover(const parse_error &e, size_t start) {
+	// only an error beyond max_errors shows that there are too many
+	if (max_errors && errors.size() >= max_errors) {
+		gave_up_early = true;
+		throw gave_up();
+	}
+	errors.push_back(e);
+	if (at_end())
+		throw gave_up();
+	synchronize();
+	if (current == start)
+		++current;
+	if (at_end())
+		throw gave_up();
+}
 
-	std::function<pointer_to<ast::declaration_specifiers>()> declaration_specifiers;
-	std::function<pointer_to<ast::declarator>(bool)> declarator;
+namespace {
+	// half of the stack a thread gets, the rest is for the lexer and for error handling further down
+	size_t stack_budget() {
+		static const size_t budget = [] {
+			rlimit limit;
+			size_t size = 2 << 20;	// what glibc gives threads when the stack is unlimited
+			if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+				size = limit.rlim_cur;
+			return size / 2;
+		}();
+		return budget;
+	}
+}
+
+// the stack grows downwards on every platform we build for
+parser::nesting::nesting(parser &p) : p(p) {
+	uintptr_t here = uintptr_t(__builtin_frame_address(0));
+	if ((p.max_depth && p.depth >= p.max_depth) || p.stack_start > here + stack_budget())
+		throw parse_error(p.peek(), "Nesting too deep.");
+	p.depth++;
+}
 
-	rule(identifier) {
-		auto tok = consume(token::identifier, "Expect identifier.");
-		return make_node<ast::identifier>(tok);
+pointer_to<ast::identifier> parser::identifier() {
+	consume(token::identifier, "Expect identifier.");
+	return make_node<ast::identifier>(last());
+}
+
+/* 
+ * Expressions.
+ *
+ */
+
+// the rest of '(' type-name ')', in casts and sizeof.
+// fails without consuming anything when what follows is not a type, e.g. the parenthesized expression in "(a) + b"
+expected<pointer_to<type_expression>> parser::type_name() {
+	if (!starts_type_name())
+		return expected<pointer_to<type_expression>>::fail(current, "Expect type name.");
+	size_t start = current;
+	auto spec = declaration_specifiers();
+	auto decl = declarator(true);
+	size_t failed_at = current;
+	if (decl->name) {
+		failed_at = current-1;
+		current = start;
+		return expected<pointer_to<type_expression>>::fail(failed_at, "Cannot give declarator names in type names.");
+	}
+	if (!match(token::paren_r)) {
+		current = start;
+		return expected<pointer_to<type_expression>>::fail(failed_at, "Expect ')' after type name.");
+	}
+	return make_node<type_expression>(spec, decl);
+}
+
+// expressions with multiple operands, i.e. arithemtic, logical, etc are parsed by precedence climbing.
+// a run of operators on the same level becomes one n-ary node, as in "a + b - c"
+namespace {
+	enum precedence : uint8_t {
+		not_binary, comma_prec, assign_prec, conditional_prec, logical_or_prec, logical_and_prec,
+		binary_or_prec, binary_xor_prec, binary_and_prec, equality_prec, relational_prec,
+		shift_prec, additive_prec, multiplicative_prec
+	};
+	enum nary_kind : uint8_t { sequence_node, assign_node, arith_node, bitwise_node, logical_node, equality_node, relational_node };
+	struct binary_op {
+		precedence prec = not_binary;
+		nary_kind kind = arith_node;
 	};
+	constexpr auto binary_ops = [] {
+		std::array<binary_op, token::last_type+1> table {};
+		auto set = [&](precedence prec, nary_kind kind, std::initializer_list<enum token::type> ops) {
+			for (auto op : ops)
+				table[op] = { prec, kind };
+		};
+		set(comma_prec,          sequence_node,   { token::comma });
+		set(assign_prec,         assign_node,     { token::equals, token::star_equals, token::slash_equals, token::percent_equals, token::plus_equals, token::minus_equals,
+		                                            token::left_left_equals, token::right_right_equals, token::amp_equals, token::hat_equals, token::pipe_equals });
+		set(conditional_prec,    arith_node,      { token::question });	// handled separately
+		set(logical_or_prec,     logical_node,    { token::pipe_pipe });
+		set(logical_and_prec,    logical_node,    { token::amp_amp });
+		set(binary_or_prec,      bitwise_node,    { token::pipe });
+		set(binary_xor_prec,     bitwise_node,    { token::hat });
+		set(binary_and_prec,     bitwise_node,    { token::ampersand });
+		set(equality_prec,       equality_node,   { token::equal_equal, token::exclamation_equal });
+		set(relational_prec,     relational_node, { token::left, token::right, token::left_equal, token::right_equal });
+		set(shift_prec,          bitwise_node,    { token::left_left, token::right_right });
+		set(additive_prec,       arith_node,      { token::plus, token::minus });
+		set(multiplicative_prec, arith_node,      { token::star, token::slash, token::percent });
+		return table;
+	}();
 
-	/* 
-	 * Expressions.
-	 *
-	 */
-
-	rule(primary_exp) -> pointer_to<ast::expression> {
-		if (match(token::identifier))
-			return make_node<ast::identifier>(previous());
-		else if (match(token::integral))
-			return make_node<ast::integral_lit>(previous());
-		else if (match(token::floating))
-			return make_node<ast::float_lit>(previous());
-		else if (match(token::character))
-			return make_node<ast::character_lit>(previous());
-		else if (match(token::string))
-			return make_node<ast::string_lit>(previous());
-		else if (match(token::paren_l)) {
-			auto exp = expression();
-			consume(token::paren_r, "Expect ')' after expression.");
-			return exp;
-		}
-		else
-			throw parse_error(peek(), "Expect expression.");
- 	};
-	rule(postfix_exp) -> pointer_to<ast::expression> {
-		auto exp = primary_exp();
-		if (match(token::paren_l)) {
-			auto opening = previous();
-			auto call = make_node<ast::call>(opening, exp);
-			if (!check(token::paren_r))
-				do {
-					auto next_arg = assignment_exp();
-					call->add(next_arg);
-				} while (match(token::comma));
-			consume(token::paren_r, "Expect ')' at end of call.");
-			return call;
-		}
-		else if (match(token::bracket_l)) {
-			auto opening = previous();
-			auto subscript = expression();
-			consume(token::bracket_r, "Expect ']' after subscript.");
-			return make_node<ast::subscript>(opening, exp, subscript);
-		}
-		else if (match(token::dot, token::arrow)) {
-			auto accessor = previous();
-			auto inner = identifier();
-			return make_node<ast::member_access>(accessor, exp, inner);
+	pointer_to<n_ary> make_nary(nary_kind kind, token_ref op, pointer_to<ast::expression> lhs, pointer_to<ast::expression> rhs) {
+		switch (kind) {
+		case sequence_node:   return make_node<sequence>(op, lhs, rhs);
+		case assign_node:     return make_node<assign>(op, lhs, rhs);
+		case arith_node:      return make_node<arith>(op, lhs, rhs);
+		case bitwise_node:    return make_node<bitwise>(op, lhs, rhs);
+		case logical_node:    return make_node<logical>(op, lhs, rhs);
+		case equality_node:   return make_node<equality>(op, lhs, rhs);
+		case relational_node: return make_node<relational>(op, lhs, rhs);
 		}
-		else if (match(token::plus_plus, token::minus_minus)) {
-			auto op = previous();
-			return make_node<postfix>(op, exp);
-		}
-		return exp;
+		assert(false);
+		return nullptr;
+	}
+
+	// a production waiting for the operand that is being parsed
+	struct pending_exp {
+		enum step : uint8_t {
+			binary,            // the left operand on a level of operators binding at least as tight as prec
+			consequent,        // lhs '?' ... ':'
+			alternative,       // lhs '?' middle ':' ...
+			first_operand,     // lhs op ...
+			next_operand,      // outer ... op ...
+			cast,              // '(' type ')' ...
+			prefix,            // '++' ...
+			unary,             // op ..., including sizeof
+			postfix,           // a primary expression, which may be followed by one postfix operator
+			argument,          // call '(' ... ',' ...
+			subscript,         // lhs '[' ... ']'
+			parenthesized,     // '(' ... ')'
+		} step;
+		precedence prec;
+		binary_op op;
+		token_ref t, colon;
+		pointer_to<ast::expression> lhs = nullptr, middle = nullptr;
+		pointer_to<n_ary> outer = nullptr;
+		pointer_to<ast::call> call = nullptr;
+		pointer_to<type_expression> type = nullptr;
+		pending_exp(enum step s, precedence prec = not_binary, binary_op op = {}, token_ref t = {}) : step(s), prec(prec), op(op), t(t) {}
 	};
-	rrule(unary_exp, expression) {
-		if (match(token::plus_plus, token::minus_minus)) {
-			auto op = previous();
-			auto sub = unary_exp();
-			return make_node<prefix>(op, sub);
-		}
-		else if (match(token::ampersand, token::star, token::plus, token::minus, token::tilde, token::exclamation)) {
-			auto op = previous();
-			auto sub = cast_exp();
-			return make_node<unary>(op, sub);
+}
+
+// all operators binding at least as tight as min_prec, and below them cast, unary, postfix and primary expressions.
+// these call each other for every operator and parenthesis, so rather than by recursion they are parsed on an
+// explicit stack of pending productions, and the nesting of an expression is bounded by max_depth alone.
+// only type names in casts and sizeof recurse, through the declarator, which checks the stack as statements do.
+pointer_to<ast::expression> parser::binary_exp(uint8_t min_prec) {
+	struct restore_depth {	// of the levels still open when an error unwinds
+		parser &p;
+		size_t depth;
+		~restore_depth() { p.depth = depth; }
+	} restore { *this, depth };
+	auto deeper = [&] {
+		if (max_depth && depth >= max_depth)
+			throw parse_error(peek(), "Nesting too deep.");
+		depth++;
+	};
+
+	std::vector<pending_exp> todo;
+	pointer_to<ast::expression> value = nullptr;
+	auto operand = [&](const pending_exp &then, precedence prec) {
+		todo.push_back(then);
+		todo.push_back({ pending_exp::binary, prec });
+	};
+	// what follows lhs on a level: either an operator that wants another operand, or the end of the level
+	auto operators = [&](precedence prec, pointer_to<ast::expression> lhs) {
+		binary_op op = binary_ops[type_at(current)];
+		if (op.prec == not_binary || op.prec < prec) {
+			depth--;
+			value = lhs;
+			return false;
 		}
-		else if (match(token::size_of)) {
-			auto sizeof_token = previous();
-			if (match(token::paren_l)) {
-				auto spec = declaration_specifiers();
-				auto decl = declarator(true);
-				if (decl->name)
-					throw parse_error(previous(), "Cannot give declarator names in sizeof type-expressions.");
-				consume(token::paren_r, "Expect ')' after type name.");
-				return make_node<unary>(sizeof_token, make_node<type_expression>(spec, decl));
+		advance();
+		bool conditional = op.prec == conditional_prec;
+		pending_exp then { conditional ? pending_exp::consequent : pending_exp::first_operand, prec, op, last() };
+		then.lhs = lhs;
+		operand(then, conditional ? comma_prec : precedence(op.prec + 1));
+		return true;
+	};
+	auto more_operands = [&](pending_exp level, pointer_to<n_ary> outer) {
+		if (binary_ops[type_at(current)].prec != level.op.prec)
+			return operators(level.prec, outer);
+		advance();
+		level.step = pending_exp::next_operand;
+		level.t = last();
+		level.outer = outer;
+		operand(level, precedence(level.op.prec + 1));
+		return true;
+	};
+
+	todo.push_back({ pending_exp::binary, precedence(min_prec) });
+	while (true) {
+		// down from the binary level on top to the first primary expression of its operand
+		deeper();
+		value = nullptr;
+		for (bool cast = true; !value; ) {
+			size_t start = current;
+			if (cast && match(token::paren_l)) {
+				auto type = type_name();
+				if (type) {
+					todo.push_back({ pending_exp::cast });
+					todo.back().t = last();
+					todo.back().type = type.value;
+					continue;
+				}
+				if (type.failed_at > start+1)	// it is a type, but a broken one
+					throw parse_error(token_at(type.failed_at), type.failure);
+				current = start;
 			}
-			else {
-				auto sub = unary_exp();
-				return make_node<unary>(sizeof_token, sub);
+			deeper();
+			if (match(token::plus_plus, token::minus_minus)) {
+				todo.push_back({ pending_exp::prefix });
+				todo.back().t = last();
+				cast = false;
 			}
-		}
-		return postfix_exp();
-	};
-	frule(cast_exp) -> pointer_to<ast::expression> {
-		if (match(token::paren_l)) {
-			if (next_is_expression()) {
-				rewind1();
-				return unary_exp();
+			else if (match(token::ampersand, token::star, token::plus, token::minus, token::tilde, token::exclamation)) {
+				todo.push_back({ pending_exp::unary });
+				todo.back().t = last();
+				cast = true;
 			}
-			auto spec = declaration_specifiers();
-			auto decl = declarator(true);
-			if (decl->name)
-				throw parse_error(previous(), "Cannot give declarator names in cast's type-expressions.");
-			consume(token::paren_r, "Expect ')' after type name.");
-			auto type = make_node<type_expression>(spec, decl);
-			if (check(token::paren_r)) {
-				auto closing = consume(token::paren_r, "Expect ')' after cast target type.");
-				auto subexp = cast_exp();
-				return make_node<cast>(closing, type, subexp);
+			else if (match(token::size_of)) {
+				auto sizeof_token = last();
+				start = current;
+				if (match(token::paren_l)) {
+					auto type = type_name();
+					if (type) {
+						depth--;
+						value = make_node<ast::unary>(sizeof_token, type.value);
+						break;
+					}
+					if (type.failed_at > start+1)
+						throw parse_error(token_at(type.failed_at), type.failure);
+					current = start;
+				}
+				todo.push_back({ pending_exp::unary });
+				todo.back().t = sizeof_token;
+				cast = false;
+			}
+			else {
+				todo.push_back({ pending_exp::postfix });
+				if (match(token::identifier))
+					value = make_node<ast::identifier>(last());
+				else if (match(token::integral))
+					value = make_node<ast::integral_lit>(last());
+				else if (match(token::floating))
+					value = make_node<ast::float_lit>(last());
+				else if (match(token::character))
+					value = make_node<ast::character_lit>(last());
+				else if (match(token::string))
+					value = make_node<ast::string_lit>(last());
+				else if (match(token::paren_l)) {
+					operand({ pending_exp::parenthesized }, comma_prec);
+					deeper();
+					cast = true;
+				}
+				else
+					throw parse_error(peek(), "Expect expression.");
 			}
 		}
-		return unary_exp();
-	};
-	
-	// expressions with multiple operands, i.e. arithemtic, logical, etc
-	auto parse_nary = [&]<typename node_t>(auto &subrule, auto... t) {
-		pointer_to<node_t> outer = nullptr;
-		auto lhs = subrule();
-		while (match(t...)) {
-			token op = previous();
-			auto rhs = subrule();
-			if (!outer)
-				outer = make_node<node_t>(op, lhs, rhs);
-			else
-				outer->add(op, rhs);
-		}
-		return outer ? outer : lhs;
-	};
-	rule(multiplicative_exp) {
-		return parse_nary.template operator()<ast::arith>(cast_exp, token::star, token::slash, token::percent);
-	};
-	rule(additive_exp) {
-		return parse_nary.template operator()<ast::arith>(multiplicative_exp, token::plus, token::minus);
-	};
-	rule(shift_exp) {
-		return parse_nary.template operator()<ast::bitwise>(additive_exp, token::left_left, token::right_right);
-	};
-	rule(relational_exp) {
-		return parse_nary.template operator()<ast::relational>(shift_exp, token::left, token::right, token::left_equal, token::right_equal);
-	};
-	rule(equality_exp) {
-		return parse_nary.template operator()<ast::equality>(relational_exp, token::equal_equal, token::exclamation_equal);
-	};
-	rule(binary_xor_exp) {
-		return parse_nary.template operator()<ast::bitwise>(equality_exp, token::hat);
-	};
-	rule(binary_and_exp) {
-		return parse_nary.template operator()<ast::bitwise>(binary_xor_exp, token::ampersand);
-	};
-	rule(binary_or_exp) {
-		return parse_nary.template operator()<ast::bitwise>(binary_and_exp, token::pipe);
-	};
-	rule(logical_and_exp) {
-		return parse_nary.template operator()<ast::logical>(binary_or_exp, token::amp_amp);
-	};
-	rule(logical_or_exp) {
-		return parse_nary.template operator()<ast::logical>(logical_and_exp, token::pipe_pipe);
-	};
-	rrule(conditional_exp,expression) {
-		auto exp = logical_or_exp();
-		if (match(token::question)) {
-			token q = previous();
-			auto consequent = expression();
-			auto c = consume(token::colon, "Expect ':' following '?'-subexpression.");
-			auto alternative = conditional_exp();
-			auto cond = make_node<ast::conditional>(exp, q, consequent, c, alternative);
-			return cond;
+
+		// and up again, through the productions that were waiting for it, until one wants another operand
+		for (bool wants_operand = false; !wants_operand; ) {
+			if (todo.empty())
+				return value;
+			auto p = todo.back();
+			todo.pop_back();
+			switch (p.step) {
+			case pending_exp::binary:
+				wants_operand = operators(p.prec, value);
+				break;
+			case pending_exp::consequent:
+				consume(token::colon, "Expect ':' following '?'-subexpression.");
+				p.step = pending_exp::alternative;
+				p.middle = value;
+				p.colon = last();
+				operand(p, conditional_prec);
+				wants_operand = true;
+				break;
+			case pending_exp::alternative:
+				wants_operand = operators(p.prec, make_node<ast::conditional>(p.lhs, p.t, p.middle, p.colon, value));
+				break;
+			case pending_exp::first_operand:
+				wants_operand = more_operands(p, make_nary(p.op.kind, p.t, p.lhs, value));
+				break;
+			case pending_exp::next_operand:
+				p.outer->add(p.t, value);
+				wants_operand = more_operands(p, p.outer);
+				break;
+			case pending_exp::cast:
+				value = make_node<ast::cast>(p.t, p.type, value);
+				break;
+			case pending_exp::prefix:
+				depth--;
+				value = make_node<ast::prefix>(p.t, value);
+				break;
+			case pending_exp::unary:
+				depth--;
+				value = make_node<ast::unary>(p.t, value);
+				break;
+			case pending_exp::postfix:
+				if (match(token::paren_l)) {
+					p.step = pending_exp::argument;
+					p.call = make_node<ast::call>(last(), value);
+					if (!check(token::paren_r)) {
+						operand(p, assign_prec);
+						wants_operand = true;
+						break;
+					}
+					consume(token::paren_r, "Expect ')' at end of call.");
+					value = p.call;
+				}
+				else if (match(token::bracket_l)) {
+					p.step = pending_exp::subscript;
+					p.t = last();
+					p.lhs = value;
+					operand(p, comma_prec);
+					wants_operand = true;
+					break;
+				}
+				else if (match(token::dot, token::arrow)) {
+					auto accessor = last();
+					auto inner = identifier();
+					value = make_node<ast::member_access>(accessor, value, inner);
+				}
+				else if (match(token::plus_plus, token::minus_minus))
+					value = make_node<ast::postfix>(last(), value);
+				depth--;
+				break;
+			case pending_exp::argument:
+				p.call->add(value);
+				if (match(token::comma)) {
+					operand(p, assign_prec);
+					wants_operand = true;
+					break;
+				}
+				consume(token::paren_r, "Expect ')' at end of call.");
+				depth--;
+				value = p.call;
+				break;
+			case pending_exp::subscript:
+				consume(token::bracket_r, "Expect ']' after subscript.");
+				depth--;
+				value = make_node<ast::subscript>(p.t, p.lhs, value);
+				break;
+			case pending_exp::parenthesized:
+				consume(token::paren_r, "Expect ')' after expression.");
+				break;
+			}
 		}
-		return exp;
-	};
-	frule(assignment_exp) {
-		return parse_nary.template operator()<ast::assign>(conditional_exp, 
-														   token::equals, token::star_equals, token::slash_equals, token::percent_equals, token::plus_equals, token::minus_equals, 
-														   token::left_left_equals, token::right_right_equals, token::percent_equals, token::amp_equals, token::hat_equals, token::pipe_equals);
-	};
-	frule(expression) {
-		return parse_nary.template operator()<sequence>(assignment_exp, token::comma);
-	};
-	
-	rule(expression_statement) {
-		auto exp = expression();
-		consume(token::semicolon, "Expect a ';' after expression.");
-		return make_node<ast::expression_stmt>(exp);
-	};
-	
-	/* 
-	 * Statements.
-	 *
-	 */
-	std::function<pointer_to<ast::declaration>()> parameter_declaration;
-	std::function<pointer_to<ast::declaration>(bool)> external_declaration;;
-	
-	std::function<pointer_to<ast::statement>()> statement;	//XXX might be statement
-	std::function<pointer_to<ast::block>()> compound_statement;
+	}
+}
+pointer_to<ast::expression> parser::conditional_exp() {
+	return binary_exp(conditional_prec);
+}
+pointer_to<ast::expression> parser::assignment_exp() {
+	return binary_exp(assign_prec);
+}
+pointer_to<ast::expression> parser::expression() {
+	return binary_exp(comma_prec);
+}
 
-	rule(if_statement) {
+/* 
+ * Statements.
+ *
+ */
+
+pointer_to<ast::statement> parser::expression_statement() {
+	auto exp = expression();
+	consume(token::semicolon, "Expect a ';' after expression.");
+	return make_node<ast::expression_stmt>(exp);
+}
+// an 'else if' is taken care of here rather than by recursion, so that long chains of them do not nest
+pointer_to<ast::statement> parser::if_statement() {
+	pointer_to<if_stmt> first = nullptr, last = nullptr;
+	while (true) {
 		consume(token::paren_l, "Expect '(' after 'if'");
 		auto condition = expression();
 		consume(token::paren_r, "Expect ')' after 'if' condition");
 		auto consequent = statement();
-		pointer_to<ast::statement> alternate = nullptr;
-		if (match(token::kw_else))
-			alternate = statement();
-		return make_node<if_stmt>(condition, consequent, alternate);
-	};
-	rule(switch_statement) {
-		consume(token::paren_l, "Expect '(' after 'switch'");
-		auto condition = expression();
-		consume(token::paren_r, "Expect ')' after 'switch' expression");
-		auto body = statement();
-		return make_node<switch_stmt>(condition, body);
-	};
-	prule(return_statement, token t) {
-		if (match(token::semicolon))
-			return make_node<return_stmt>(t);
-		auto expr = expression();
-		consume(token::semicolon, "Expect ';' after return expression.");
-		return make_node<return_stmt>(t, expr);
-	};
-	prule(break_statement, token t) {
-		consume(token::semicolon, "Expect ';' after 'break'.");
-		return make_node<break_stmt>(t);
-	};
-	prule(continue_statement, token t) {
-		consume(token::semicolon, "Expect ';' after 'continue'.");
-		return make_node<continue_stmt>(t);
-	};
-	prule(goto_statement, token t) {
-		auto id = identifier();
-		consume(token::semicolon, "Expect ';' after goto label.");
-		return make_node<goto_stmt>(t, id);
-	};
-	prule(case_statement, token t) {
-		auto id = conditional_exp();
-		consume(token::colon, "Expect ':' after case label.");
-		return make_node<label_stmt>(t, id);
-	};
-	prule(default_statement, token t) {
-		consume(token::colon, "Expect ':' after default label.");
-		return make_node<label_stmt>(t);
-	};
-	rule(while_statement) {
-		consume(token::paren_l, "Expect '(' after while.");
-		auto test = expression();
-		consume(token::paren_r, "Expect ')' after while condition.");
-		auto stmt = statement();
-		return make_node<while_loop>(test, stmt);
-	};
-	rule(dowhile_statement) {
-		auto stmt = statement();
-		consume(token::kw_while, "Expect 'while' after 'do ...'.");
-		consume(token::paren_l, "Expect '(' after 'while'");
-		auto test = expression();
-		consume(token::paren_r, "Expect ')' after do-while condition.");
-		consume(token::semicolon, "Expect ';' after do-while.");
-		return make_node<dowhile_loop>(test, stmt);
-	};
-	rule(for_statement) {
-		consume(token::paren_l, "Expect '(' after for.");
-		pointer_to<ast::statement> init = nullptr;
-		if (!match(token::semicolon))
-			if (next_is_expression())
-				init = expression_statement();
-			else
-				init = external_declaration(false);
-		pointer_to<ast::expression> expr = nullptr;
-		if (match(token::semicolon)) {
-			expr = make_node<integral_lit>(token(token::integral, "1", -1, -1, ""));
-		}
-		else {
-			expr = expression();
-			consume(token::semicolon, "Expect ';' after for condition.");
+		auto next = make_node<if_stmt>(condition, consequent);
+		if (last)
+			last->alternate = next;
+		else
+			first = next;
+		last = next;
+		if (!match(token::kw_else))
+			break;
+		if (!match(token::kw_if)) {
+			last->alternate = statement();
+			break;
 		}
-		pointer_to<ast::expression> step = nullptr;
-		if (!check(token::paren_r))
-			step = expression();
-		consume(token::paren_r, "Expect ')' after for.");
-		auto body = statement();
-		return make_node<for_loop>(init, expr, step, body);
-	};
+	}
+	return first;
+}
+pointer_to<ast::statement> parser::switch_statement() {
+	consume(token::paren_l, "Expect '(' after 'switch'");
+	auto condition = expression();
+	consume(token::paren_r, "Expect ')' after 'switch' expression");
+	auto body = statement();
+	return make_node<switch_stmt>(condition, body);
+}
+pointer_to<ast::statement> parser::return_statement(token_ref t) {
+	if (match(token::semicolon))
+		return make_node<return_stmt>(t);
+	auto expr = expression();
+	consume(token::semicolon, "Expect ';' after return expression.");
+	return make_node<return_stmt>(t, expr);
+}
+pointer_to<ast::statement> parser::break_statement(token_ref t) {
+	consume(token::semicolon, "Expect ';' after 'break'.");
+	return make_node<break_stmt>(t);
+}
+pointer_to<ast::statement> parser::continue_statement(token_ref t) {
+	consume(token::semicolon, "Expect ';' after 'continue'.");
+	return make_node<continue_stmt>(t);
+}
+pointer_to<ast::statement> parser::goto_statement(token_ref t) {
+	auto id = identifier();
+	consume(token::semicolon, "Expect ';' after goto label.");
+	return make_node<goto_stmt>(t, id);
+}
+pointer_to<ast::statement> parser::case_statement(token_ref t) {
+	auto id = conditional_exp();
+	consume(token::colon, "Expect ':' after case label.");
+	return make_node<label_stmt>(t, id);
+}
+pointer_to<ast::statement> parser::default_statement(token_ref t) {
+	consume(token::colon, "Expect ':' after default label.");
+	return make_node<label_stmt>(t);
+}
+pointer_to<ast::statement> parser::while_statement() {
+	consume(token::paren_l, "Expect '(' after while.");
+	auto test = expression();
+	consume(token::paren_r, "Expect ')' after while condition.");
+	auto stmt = statement();
+	return make_node<while_loop>(test, stmt);
+}
+pointer_to<ast::statement> parser::dowhile_statement() {
+	auto stmt = statement();
+	consume(token::kw_while, "Expect 'while' after 'do ...'.");
+	consume(token::paren_l, "Expect '(' after 'while'");
+	auto test = expression();
+	consume(token::paren_r, "Expect ')' after do-while condition.");
+	consume(token::semicolon, "Expect ';' after do-while.");
+	return make_node<dowhile_loop>(test, stmt);
+}
+pointer_to<ast::statement> parser::for_statement() {
+	consume(token::paren_l, "Expect '(' after for.");
+	pointer_to<ast::statement> init = nullptr;
+	if (!match(token::semicolon)) {
+		if (next_is_expression())
+			init = expression_statement();
+		else
+			init = external_declaration(false);
+	}
+	pointer_to<ast::expression> expr = nullptr;
+	if (match(token::semicolon)) {
+		expr = make_node<integral_lit>(token_ref(token_ref::implied_one));
+	}
+	else {
+		expr = expression();
+		consume(token::semicolon, "Expect ';' after for condition.");
+	}
+	pointer_to<ast::expression> step = nullptr;
+	if (!check(token::paren_r))
+		step = expression();
+	consume(token::paren_r, "Expect ')' after for.");
+	auto body = statement();
+	return make_node<for_loop>(init, expr, step, body);
+}
 
-	// the loop body should be in statement()
-	frule(statement) -> pointer_to<ast::statement> {
-// 		if (verbose) {
-// 			log << "at statement(): next_is_exp=" << next_is_expression() << endl;
-// 			log_tokens(6);
-// 		}
-		// first one is a special case
-		if (check(token::identifier) && check1(token::colon)) {
-			auto id = identifier();
-			advance();
-			return make_node<label_stmt>(id);
-		}
-		// then check the keyword-driven cases in order
-		if (next_is_expression())      return expression_statement();
-		if (match(token::kw_if))       return if_statement();
-		if (match(token::kw_switch))   return switch_statement();
-		if (match(token::kw_return))   return return_statement(previous());
-		if (match(token::kw_break))    return break_statement(previous());
-		if (match(token::kw_continue)) return continue_statement(previous());
-		if (match(token::kw_goto))     return goto_statement(previous());
-		if (match(token::kw_case))     return case_statement(previous());
-		if (match(token::kw_default))  return default_statement(previous());
-		if (match(token::kw_while))    return while_statement();
-		if (match(token::kw_do))       return dowhile_statement();
-		if (match(token::kw_for))      return for_statement();
-		if (match(token::brace_l))     return compound_statement();
-		if (match(token::semicolon))   return make_node<block>();
-		return external_declaration(false);
-	};
+// the loop body should be in statement()
+pointer_to<ast::statement> parser::statement() {
+	nesting deeper(*this);
+	// first one is a special case
+	if (check(token::identifier) && check1(token::colon)) {
+		auto id = identifier();
+		advance();
+		return make_node<label_stmt>(id);
+	}
+	// then check the keyword-driven cases in order
+	if (next_is_expression())      return expression_statement();
+	if (match(token::kw_if))       return if_statement();
+	if (match(token::kw_switch))   return switch_statement();
+	if (match(token::kw_return))   return return_statement(last());
+	if (match(token::kw_break))    return break_statement(last());
+	if (match(token::kw_continue)) return continue_statement(last());
+	if (match(token::kw_goto))     return goto_statement(last());
+	if (match(token::kw_case))     return case_statement(last());
+	if (match(token::kw_default))  return default_statement(last());
+	if (match(token::kw_while))    return while_statement();
+	if (match(token::kw_do))       return dowhile_statement();
+	if (match(token::kw_for))      return for_statement();
+	if (match(token::brace_l))     return compound_statement();
+	if (match(token::semicolon))   return make_node<block>();
+	return external_declaration(false);
+}
 
-	frule(compound_statement) {
-		// the opening brace is consumed already
-		push_scope(previous());
-		vector<pointer_to<ast::statement>> statements;
-		while (!match(token::brace_r)) {
+pointer_to<ast::block> parser::compound_statement() {
+	// the opening brace is consumed already
+	push_scope();
+	std::vector<pointer_to<ast::statement>> statements;	// the block gets exactly as much room as needed
+	while (!match(token::brace_r)) {
+		size_t start = current;
+		try {
 			statements.push_back(statement());
 		}
-		pop_scope();
-		return make_node<ast::block>(statements);
-	};
-
-	rule(struct_declaration) {
-		// a declaration inside of a struct
-		auto spec = declaration_specifiers();
-		auto declaration = make_node<ast::var_declarations>(spec);
-		while (!match(token::semicolon)) {
-			auto decl = declarator(false);
-			pointer_to<ast::expression> fieldwidth = nullptr;
-			if (match(token::colon))
-				fieldwidth = conditional_exp();
-			declaration->add_width_decl(decl, fieldwidth);
-			if (!check(token::semicolon))
-				consume(token::comma, "Expect ';' or ',' after struct declarator.");
+		catch (parse_error &e) {
+			recover(e, start);
 		}
-		return declaration;
-	};
+	}
+	pop_scope();
+	return make_node<ast::block>(statements);
+}
+
+/* 
+ * Declarations.
+ *
+ */
+
+pointer_to<ast::var_declarations> parser::struct_declaration() {
+	// a declaration inside of a struct
+	auto spec = declaration_specifiers();
+	auto declaration = make_node<ast::var_declarations>(spec);
+	while (!match(token::semicolon)) {
+		auto decl = declarator(false);
+		pointer_to<ast::expression> fieldwidth = nullptr;
+		if (match(token::colon))
+			fieldwidth = conditional_exp();
+		declaration->add_width_decl(decl, fieldwidth);
+		if (!check(token::semicolon))
+			consume(token::comma, "Expect ';' or ',' after struct declarator.");
+	}
+	return declaration;
+}
 
-	prule(struct_or_union, token keyword) {
-		// we have parsed the keyword already
-		pointer_to<ast::identifier> name = nullptr;
-		if (match(token::identifier))
-			name = make_node<ast::identifier>(previous());
-		auto structure = make_node<struct_union>(keyword, name);
-		// if not named, declaration-list is not optional
-		if (!name)
-			consume(token::brace_l, "Expected '{' after anonymous struct or union.");
-		else if (!match(token::brace_l)) // consumes the brace if present
-			return structure;
-		// parse declaration list
-		push_scope(previous());
-		while (!match(token::brace_r)) {
+pointer_to<ast::struct_union> parser::struct_or_union(token_ref keyword, bool is_struct) {
+	// we have parsed the keyword already
+	pointer_to<ast::identifier> name = nullptr;
+	if (match(token::identifier))
+		name = make_node<ast::identifier>(last());
+	auto structure = make_node<struct_union>(keyword, is_struct, name);
+	// if not named, declaration-list is not optional
+	if (!name)
+		consume(token::brace_l, "Expected '{' after anonymous struct or union.");
+	else if (!match(token::brace_l)) // consumes the brace if present
+		return structure;
+	// parse declaration list
+	push_scope();
+	while (!match(token::brace_r)) {
+		size_t start = current;
+		try {
 			auto decl = struct_declaration();
 			structure->add(decl);
 		}
-		pop_scope();
-		return structure;
-	};
-	rule(enum_specifier) {
-		// we have parsed the enum keyword already
-		pointer_to<ast::identifier> name = nullptr;
-		if (match(token::identifier))
-			name = make_node<ast::identifier>(previous());
-		auto enumeration = make_node<ast::enumeration>(name);
-		// if not named, enumerator-list is not optional
-		if (!name)
-			consume(token::brace_l, "Expected '{' after anonymous struct or union.");
-		else if (!match(token::brace_l)) // consumes the brace if present
-			return enumeration;
-		while (true) {
-			auto name = identifier();
-			pointer_to<ast::expression> value = nullptr;
-			if (match(token::equals))
-				value = conditional_exp();
-			enumeration->add(name, value);
-			if (peek() == token::brace_r)
-				break;
-			else if (peek() == token::comma && peek1() == token::brace_r) {
-				advance();
-				break;
-			}
-			consume(token::comma, "Expect ',' or '}' after enumeration item.");
+		catch (parse_error &e) {
+			recover(e, start);
 		}
-		consume(token::brace_r, "Expect ',' or '}' after enumeration item.");
+	}
+	pop_scope();
+	return structure;
+}
+pointer_to<ast::enumeration> parser::enum_specifier() {
+	// we have parsed the enum keyword already
+	pointer_to<ast::identifier> name = nullptr;
+	if (match(token::identifier))
+		name = make_node<ast::identifier>(last());
+	auto enumeration = make_node<ast::enumeration>(name);
+	// if not named, enumerator-list is not optional
+	if (!name)
+		consume(token::brace_l, "Expected '{' after anonymous struct or union.");
+	else if (!match(token::brace_l)) // consumes the brace if present
 		return enumeration;
-	};
-
-	frule(declaration_specifiers) {
-		// parse all possible specifiers into one node
-		auto all = make_node<ast::declaration_specifiers>();
-		bool int_mod = false;
-		helper(type_duplicate_check) {
-			if (all->type)
-				throw parse_error(previous(), "Duplicate type in declaration.");
-		};
-		helper(probably_builtin_type) {
-			if (check(token::identifier) && peek().text.starts_with("__builtin_")) {
-				advance();
-				return true;
-			}
-			return false;
-		};
-		while (true) {
-			if (match(token::kw_void, token::kw_char, token::kw_int, token::kw_float, token::kw_double, token::kw_bool, token::kw_complex)) {
-				type_duplicate_check();
-				all->type = make_node<ast::type_name>(previous());
-			}
-			else if (match(token::type_name) || probably_builtin_type())	{
-				type_duplicate_check();
-				all->type = make_node<ast::type_name>(previous());
-			}
-			else if (match(token::kw_unsigned, token::kw_signed, token::kw_long, token::kw_short)) {
-				int_mod = true;
-				all->add(make_node<ast::type_modifier>(previous()));
-			}
-			else if (match(token::kw_const, token::kw_volatile, token::kw_auto, token::kw_static, token::kw_register, token::kw_extern, token::kw_typedef)) {
-				all->add(make_node<ast::type_qualifier>(previous()));
-				if (previous() == token::kw_register)
-					int_mod = true;
-			}
-			else if (match(token::kw_struct, token::kw_union)) {
-				type_duplicate_check();
-				all->type = struct_or_union(previous());
-			}
-			else if (match(token::kw_enum)) {
-				type_duplicate_check();
-				all->type = enum_specifier();
-			}
-			else break;
+	while (true) {
+		auto name = identifier();
+		pointer_to<ast::expression> value = nullptr;
+		if (match(token::equals))
+			value = conditional_exp();
+		enumeration->add(name, value);
+		if (check(token::brace_r))
+			break;
+		else if (check(token::comma) && check1(token::brace_r)) {
+			advance();
+			break;
 		}
+		consume(token::comma, "Expect ',' or '}' after enumeration item.");
+	}
+	consume(token::brace_r, "Expect ',' or '}' after enumeration item.");
+	return enumeration;
+}
 
-		if (!all->type)
-			if (int_mod)  // if there is unsigned, etc -> implicity type is int
-				all->type = make_node<ast::type_name>(token(token::kw_int, "int", -1, -1, ""));
-			else
-				throw parse_error(peek(), "Expect type name for declaration.");
-		
-		return all;
+pointer_to<ast::declaration_specifiers> parser::declaration_specifiers() {
+	// parse all possible specifiers into one node
+	auto all = make_node<ast::declaration_specifiers>();
+	bool int_mod = false;
+	auto type_duplicate_check = [&]() {
+		if (all->type)
+			throw parse_error(previous(), "Duplicate type in declaration.");
 	};
-
-	fprrule(declarator, bool allow_unnamed, declarator) {
-		auto decl = make_node<ast::declarator>();
-		// pointers
-		while (match(token::star)) {
-			bool c = false, v = false, r = false;
-			if (match(token::kw_const))    c = true;
-			if (match(token::kw_volatile)) v = true;
-			if (match(token::kw_restrict)) r = true;
-			decl->add_pointer(c, v, r);
+	auto probably_builtin_type = [&]() {
+		if (check(token::identifier) && peek().text.starts_with("__builtin_")) {
+			advance();
+			return true;
 		}
-		// name / nesting
-		if (match(token::identifier)) {
-			decl->name = make_node<ast::identifier>(previous());
+		return false;
+	};
+	while (true) {
+		if (match(token::kw_void, token::kw_char, token::kw_int, token::kw_float, token::kw_double, token::kw_bool, token::kw_complex)) {
+			type_duplicate_check();
+			all->type = make_node<ast::type_name>(last());
 		}
-		else if (match(token::paren_l)) {
-			auto nested = declarator(true); // XXX how to hook this in?
-			consume(token::paren_r, "Expect ')' after nested declarator.");
+		else if (match(token::type_name) || probably_builtin_type())	{
+			type_duplicate_check();
+			all->type = make_node<ast::type_name>(last());
 		}
-		else if (!allow_unnamed)
-			throw parse_error(peek(), "Expect name or nested declaration for declarator.");
-		// arrays and functions
-		if (check(token::bracket_l)) {
-			while (match(token::bracket_l)) {
-				pointer_to<ast::expression> const_expr = nullptr;
-				if (!check(token::bracket_r))
-					const_expr = conditional_exp();
-				decl->add_array(const_expr);
-				consume(token::bracket_r, "Expect ']' after array dimension.");
-			}
-			if (match(token::paren_l))
-				throw parse_error(previous(), "Array of functions not allowed.");
+		else if (match(token::kw_unsigned, token::kw_signed, token::kw_long, token::kw_short)) {
+			int_mod = true;
+			all->add(make_node<ast::type_modifier>(last()));
 		}
-		else if (match(token::paren_l)) {
-			if (!check(token::paren_r))
-				do 
-					if (match(token::ellipsis)) {
-						decl->ellipsis = true;
-						if (!check(token::paren_r))
-							throw parse_error(peek(), "Expect ')' after '...'");
-						break;
-					}
-					else
-						decl->add_parameter(parameter_declaration());
-				while (match(token::comma));
-			else
-				decl->add_parameter(nullptr); // meaning: function, but no specified params
-			consume(token::paren_r, "Expect ')' after function declaration");
+		else if (match(token::kw_const, token::kw_volatile, token::kw_auto, token::kw_static, token::kw_register, token::kw_extern, token::kw_typedef)) {
+			all->add(make_node<ast::type_qualifier>(last()));
+			if (previous() == token::kw_register)
+				int_mod = true;
 		}
-		return decl;
-	};
+		else if (match(token::kw_struct, token::kw_union)) {
+			type_duplicate_check();
+			all->type = struct_or_union(last(), previous() == token::kw_struct);
+		}
+		else if (match(token::kw_enum)) {
+			type_duplicate_check();
+			all->type = enum_specifier();
+		}
+		else break;
+	}
+
+	if (!all->type) {
+		if (int_mod)  // if there is unsigned, etc -> implicity type is int
+			all->type = make_node<ast::type_name>(token_ref(token_ref::implied_int));
+		else
+			throw parse_error(peek(), "Expect type name for declaration.");
+	}
 	
-	frule(parameter_declaration) {
-		auto spec = declaration_specifiers();
-		auto decl = declarator(true);
-		// this can also be w/o declarator or with "abstract-declarator" (TODO)
-		return make_node<ast::var_declarations>(spec, decl);
-	};
+	return all;
+}
 
-	pfrule(external_declaration, bool allow_function) -> pointer_to<ast::declaration> {
-		// declaration and function-definition share this part
-		auto spec = declaration_specifiers();
-		auto declaration = make_node<ast::var_declarations>(spec);
-		while (!match(token::semicolon)) {
-			auto decl = declarator(false);
-			bool is_typedef = spec->is_typedef();
-			if (is_typedef) {
-				assert(decl->name != nullptr);
-				register_type(decl->name->token);
-			}
-			if (match(token::brace_l) && allow_function) {
-				if (is_typedef)
-					throw parse_error(previous(), "Function definition cannot be a typedef.");
-				// we have a function definition
-				free_node(declaration);
-				auto block = compound_statement();
-				auto fdef = make_node<ast::function_definition>(spec, decl, block);
+pointer_to<ast::declarator> parser::declarator(bool allow_unnamed) {
+	nesting deeper(*this);
+	auto decl = make_node<ast::declarator>();
+	// pointers
+	while (match(token::star)) {
+		bool c = false, v = false, r = false;
+		if (match(token::kw_const))    c = true;
+		if (match(token::kw_volatile)) v = true;
+		if (match(token::kw_restrict)) r = true;
+		decl->add_pointer(c, v, r);
+	}
+	// name / nesting
+	if (match(token::identifier)) {
+		decl->name = make_node<ast::identifier>(last());
+	}
+	else if (match(token::paren_l)) {
+		declarator(true); // XXX how to hook this in?
+		consume(token::paren_r, "Expect ')' after nested declarator.");
+	}
+	else if (!allow_unnamed)
+		throw parse_error(peek(), "Expect name or nested declaration for declarator.");
+	// arrays and functions
+	if (check(token::bracket_l)) {
+		while (match(token::bracket_l)) {
+			pointer_to<ast::expression> const_expr = nullptr;
+			if (!check(token::bracket_r))
+				const_expr = conditional_exp();
+			decl->add_array(const_expr);
+			consume(token::bracket_r, "Expect ']' after array dimension.");
+		}
+		if (match(token::paren_l))
+			throw parse_error(previous(), "Array of functions not allowed.");
+	}
+	else if (match(token::paren_l)) {
+		if (!check(token::paren_r))
+			do 
+				if (match(token::ellipsis)) {
+					decl->ellipsis = true;
+					if (!check(token::paren_r))
+						throw parse_error(peek(), "Expect ')' after '...'");
+					break;
+				}
+				else
+					decl->add_parameter(parameter_declaration());
+			while (match(token::comma));
+		else
+			decl->add_parameter(nullptr); // meaning: function, but no specified params
+		consume(token::paren_r, "Expect ')' after function declaration");
+	}
+	return decl;
+}
+
+pointer_to<ast::declaration> parser::parameter_declaration() {
+	auto spec = declaration_specifiers();
+	auto decl = declarator(true);
+	// this can also be w/o declarator or with "abstract-declarator" (TODO)
+	return make_node<ast::var_declarations>(spec, decl);
+}
+
+pointer_to<ast::declaration> parser::external_declaration(bool allow_function) {
+	// declaration and function-definition share this part
+	auto spec = declaration_specifiers();
+	auto declaration = make_node<ast::var_declarations>(spec);
+	while (!match(token::semicolon)) {
+		auto decl = declarator(false);
+		bool is_typedef = spec->is_typedef(*tokens);
+		if (is_typedef) {
+			assert(decl->name != nullptr);
+			register_type(decl->name->token.text(*tokens));
+		}
+		if (match(token::brace_l) && allow_function) {
+			if (is_typedef)
+				throw parse_error(previous(), "Function definition cannot be a typedef.");
+			// we have a function definition
+			if (deferred) {
+				// skimming, the body is parsed later on
+				auto fdef = make_node<ast::function_definition>(spec, decl, nullptr);
+				deferred->push_back({ fdef, current, 0, defined.size() });
+				deferred->back().end = skip_body();
 				return fdef;
 			}
-			// we have a declaration
-			pointer_to<ast::expression> init = nullptr;
-			if (match(token::equals)) {
-				init = assignment_exp(); // TODO other cases, see "initializer"
-			}
-			declaration->add_init_decl(decl, init);
-			while (match(token::attribute))
-				declaration->add_attribute(previous());
-			if (!check(token::semicolon))
-				consume(token::comma, "Expect ';' or ',' after declarator.");
+			auto block = compound_statement();
+			auto fdef = make_node<ast::function_definition>(spec, decl, block);
+			return fdef;
 		}
-		return declaration;
-	};
-	
-	rule(translation_unit) {
-		auto root = make_node<ast::translation_unit>();
-		while (!at_end()) {
-			root->add(external_declaration(true));
+		// we have a declaration
+		pointer_to<ast::expression> init = nullptr;
+		if (match(token::equals)) {
+			init = assignment_exp(); // TODO other cases, see "initializer"
 		}
+		declaration->add_init_decl(decl, init);
+		while (match(token::attribute))
+			declaration->add_attribute(last());
+		if (!check(token::semicolon))
+			consume(token::comma, "Expect ';' or ',' after declarator.");
+	}
+	return declaration;
+}
+
+pointer_to<ast::translation_unit> parser::translation_unit() {
+	root = new_root();
+	while (!at_end())
+		if (auto decl = toplevel_declaration())
+			root->add(decl);
+	return root;
+}
+
+// the translation unit is not part of the arena, but owns it and the tokens
+pointer_to<ast::translation_unit> parser::new_root() {
+	auto tu = new ast::translation_unit();
+	tu->memory.push_back(memory);
+	tu->streams.push_back(tokens);
+	return tu;
+}
+
+// nullptr if the declaration was broken and has been skipped
+pointer_to<ast::declaration> parser::toplevel_declaration() {
+	size_t start = current;
+	try {
+		return external_declaration(true);
+	}
+	catch (parse_error &e) {
+		recover(e, start);
+		return nullptr;
+	}
+}
+
+void parser::reset(std::shared_ptr<token_stream> tokens, size_t from) {
+	this->tokens = tokens;
+	current = from;
+	depth = 0;
+	stack_start = uintptr_t(__builtin_frame_address(0));
+	ident_from = from;
+	identifiers.clear();
+	names.clear();
+	ident_at.clear();
+	type_depth.clear();
+	defined.clear();
+	scope_marks.clear();
+	errors.clear();
+	gave_up_early = false;
+	push_scope();
+}
+
+pointer_to<ast::translation_unit> parser::parse(std::shared_ptr<token_stream> tokens) {
+	reset(tokens);
+	memory = std::make_shared<arena>();
+	arena::use in(*memory);
+	try {
+		return translation_unit();
+	}
+	catch (gave_up) {
 		return root;
-	};
+	}
+	catch (...) {	// a lexer error, which ends the parse without a tree
+		delete root;
+		throw;
+	}
+}
+
+/* 
+ * Parallel parsing.
+ *
+ */
 
+namespace {
+	unsigned threads() {
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+}
 
-	auto x = translation_unit();
-	ast::printer p(std::cout);
-	x->traverse_with(&p);
+// the rest of a function body that is parsed later, gives the index after its closing brace
+size_t parser::skip_body() {
+	for (int depth = 1; !at_end(); ++current)
+		if (tokens->type(current) == token::brace_l)
+			++depth;
+		else if (tokens->type(current) == token::brace_r && --depth == 0)
+			return ++current;
+	throw parse_error(peek(), "Expect '}' at end of function body.");
+}
+
+pointer_to<ast::translation_unit> parser::parse_parallel(std::shared_ptr<token_stream> tokens) {
+	// first pass: everything but function bodies, which only need the typedefs declared before them
+	std::vector<deferred_body> bodies;
+	reset(tokens);
+	memory = std::make_shared<arena>();
+	arena::use in(*memory);
+	deferred = &bodies;
+	try {
+		translation_unit();
+	}
+	catch (gave_up) {
+	}
+	catch (...) {
+		deferred = nullptr;
+		delete root;
+		throw;
+	}
+	deferred = nullptr;
+	// the first pass cannot tell which errors a sequential parse reports, nor where it resumes
+	if (!errors.empty()) {
+		delete root;
+		return parse(tokens);
+	}
+
+	// second pass: the bodies, biggest first so that no thread is left with a big one at the end
+	std::vector<size_t> order(bodies.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return bodies[a].end - bodies[a].first > bodies[b].end - bodies[b].first;
+	});
+	std::atomic<size_t> next_body = 0;
+	std::atomic<bool> failed = false;
+	std::vector<std::shared_ptr<arena>> body_memory(std::min(threads(), unsigned(bodies.size())));
+	auto work = [&](unsigned thread) {
+		parser body_parser(max_errors, max_depth);
+		body_memory[thread] = body_parser.memory = std::make_shared<arena>();
+		arena::use in(*body_parser.memory);
+		for (size_t i = next_body++; i < order.size() && !failed; i = next_body++) {
+			deferred_body &body = bodies[order[i]];
+			body_parser.reset(tokens, body.first);
+			for (size_t k = 0; k < body.typedefs; ++k)
+				body_parser.register_type(names[defined[k]]);
+			try {
+				body.function->block = body_parser.compound_statement();
+			}
+			catch (gave_up) {
+			}
+			if (!body_parser.errors.empty() || body_parser.current != body.end)
+				failed = true;
+		}
+	};
+	std::vector<std::thread> pool;
+	for (unsigned i = 1; i < body_memory.size(); ++i)
+		pool.emplace_back(work, i);
+	if (!body_memory.empty())
+		work(0);
+	for (auto &t : pool)
+		t.join();
+	if (failed) {
+		body_memory.clear();
+		delete root;
+		return parse(tokens);
+	}
+	root->memory.insert(root->memory.end(), body_memory.begin(), body_memory.end());
+	return root;
 }
 
 /*
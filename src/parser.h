@@ -1,25 +1,170 @@
 #pragma once
 
 #include "token.h"
+#include "tree.h"
 
+#include <memory>
 #include <vector>
-#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <cstdint>
+#include <exception>
 
 #include <sstream>
 
-struct parse_error : public std::runtime_error {
+// messages are string literals, the full text is only put together when somebody asks for it
+struct parse_error : public std::exception {
 	token at;
-	std::string full;
-	parse_error(token at, const std::string &message) : runtime_error(message), at(at) {
-		std::ostringstream oss;
-		oss << "Parse Error: " << message << " @" << at.line << ":" << at.pos << ", got token '" << at << "'";
-		full = oss.str();
-	}
+	const char *message;
+	parse_error(token at, const char *message) : at(at), message(message) {}
 	const char* what() const noexcept override {	// order noexcept/override matters to gcc 14.2.1
+		if (full.empty()) {
+			std::ostringstream oss;
+			oss << "Parse Error: " << message << " @" << at.offset << ", got token '" << at << "'";
+			full = oss.str();
+		}
 		return full.c_str();
 	}
+	std::string report(const source &src) const;
+private:
+	mutable std::string full;
+};
+
+/* Outcome of a speculative production: a value, or why and where it does not apply.
+ * Productions returning this leave the token position as it was when they fail.
+ */
+template<typename T> struct expected {
+	T value {};
+	const char *failure = nullptr;
+	size_t failed_at = 0;
+	expected(T value) : value(value) {}
+	static expected fail(size_t at, const char *why) {
+		expected e {T{}};
+		e.failure = why;
+		e.failed_at = at;
+		return e;
+	}
+	explicit operator bool() const { return failure == nullptr; }
 };
 
-void parse(const std::vector<token> &tokens);
+/* Recursive descent parser for C, one member function per production.
+ * A parser can be used for any number of inputs, each call to parse starts over with an empty symbol table.
+ * Syntax errors do not end the parse: they are collected in 'errors' and parsing resumes after the broken
+ * statement, member or declaration, up to max_errors (0 for no limit). The tree returned then lacks the broken parts.
+ * Statements, expressions and declarators nested deeper than max_depth levels (0 for no limit) are an error as well.
+ * Expressions are parsed on an explicit stack, so only max_depth limits them. Statements and declarators recurse:
+ * nesting them so that it takes up more than half of the stack is an error too, rather than a crash once the stack is
+ * exhausted, and that is what limits them on small stacks and in sanitizer builds. Chains of 'else if' do not count.
+ * Nodes are allocated from an arena per tree and refer to tokens by their index in the stream, which the tree keeps.
+ * The caller owns the returned translation unit, deleting it frees the tree.
+ */
+class parser {
+	std::shared_ptr<token_stream> tokens;
+	size_t current = 0;
+	size_t max_errors;
+	size_t max_depth, depth = 0;
+	uintptr_t stack_start = 0;	// where the parse began on this thread's stack
+	ast::pointer_to<ast::translation_unit> root = nullptr;
+	std::shared_ptr<arena> memory;	// of the tree being built
+
+	// symbol table for lexer feedback: identifiers are interned once per occurrence,
+	// a name is a type while type_depth[id] > 0, scopes are undone from the log of defined ids
+	std::unordered_map<std::string_view, uint32_t> identifiers;
+	std::vector<std::string_view> names;
+	std::vector<uint32_t> ident_at;	// per token index from ident_from on, no_ident until first looked at
+	size_t ident_from = 0;
+	std::vector<uint32_t> type_depth;
+	std::vector<uint32_t> defined;
+	std::vector<size_t> scope_marks;
+	static constexpr uint32_t no_ident = UINT32_MAX;
+	uint32_t intern(std::string_view name);
+	void push_scope();
+	void pop_scope();
+	void register_type(std::string_view name);
+	bool is_type(size_t i);
+
+	// token access, checks only read the type unless there is an identifier that might name a type
+	enum token::type type_at(size_t i);
+	bool at_end();
+	token token_at(size_t i);
+	token previous();
+	token advance();
+	token peek();
+	bool check(enum token::type t);
+	bool check1(enum token::type t);
+	token consume(enum token::type type, const char *message);
+	ast::token_ref last() const { return ast::token_ref(current-1); }	// the token just consumed, the way nodes keep it
+	template<typename... Ts> bool match(Ts... ts);
+	bool next_is_expression();
+	bool starts_type_name();
+
+	// error recovery
+	struct gave_up {};
+	struct nesting {	// one level deeper while in scope
+		parser &p;
+		nesting(parser &p);
+		~nesting() { p.depth--; }
+	};
+	void synchronize();
+	void recover(const parse_error &e, size_t start);
 
+	ast::pointer_to<ast::identifier> identifier();
 
+	// expressions
+	expected<ast::pointer_to<ast::type_expression>> type_name();
+	ast::pointer_to<ast::expression> binary_exp(uint8_t min_prec);
+	ast::pointer_to<ast::expression> conditional_exp();
+	ast::pointer_to<ast::expression> assignment_exp();
+	ast::pointer_to<ast::expression> expression();
+
+	// statements
+	ast::pointer_to<ast::statement> expression_statement();
+	ast::pointer_to<ast::statement> if_statement();
+	ast::pointer_to<ast::statement> switch_statement();
+	ast::pointer_to<ast::statement> return_statement(ast::token_ref t);
+	ast::pointer_to<ast::statement> break_statement(ast::token_ref t);
+	ast::pointer_to<ast::statement> continue_statement(ast::token_ref t);
+	ast::pointer_to<ast::statement> goto_statement(ast::token_ref t);
+	ast::pointer_to<ast::statement> case_statement(ast::token_ref t);
+	ast::pointer_to<ast::statement> default_statement(ast::token_ref t);
+	ast::pointer_to<ast::statement> while_statement();
+	ast::pointer_to<ast::statement> dowhile_statement();
+	ast::pointer_to<ast::statement> for_statement();
+	ast::pointer_to<ast::statement> statement();
+	ast::pointer_to<ast::block> compound_statement();
+
+	// declarations
+	ast::pointer_to<ast::var_declarations> struct_declaration();
+	ast::pointer_to<ast::struct_union> struct_or_union(ast::token_ref keyword, bool is_struct);
+	ast::pointer_to<ast::enumeration> enum_specifier();
+	ast::pointer_to<ast::declaration_specifiers> declaration_specifiers();
+	ast::pointer_to<ast::declarator> declarator(bool allow_unnamed);
+	ast::pointer_to<ast::declaration> parameter_declaration();
+	ast::pointer_to<ast::declaration> external_declaration(bool allow_function);
+	ast::pointer_to<ast::translation_unit> new_root();
+	ast::pointer_to<ast::declaration> toplevel_declaration();
+	ast::pointer_to<ast::translation_unit> translation_unit();
+	void reset(std::shared_ptr<token_stream> tokens, size_t from = 0);
+
+	// function bodies left for parse_parallel's second pass
+	struct deferred_body {
+		ast::pointer_to<ast::function_definition> function;
+		size_t first, end;	// tokens after the opening brace up to and including the closing one
+		size_t typedefs;	// the file scope typedefs before it, as a prefix of 'defined'
+	};
+	std::vector<deferred_body> *deferred = nullptr;
+	size_t skip_body();
+	friend class incremental_parser;
+
+public:
+	std::vector<parse_error> errors;
+	bool gave_up_early = false;	// there were more than max_errors errors
+
+	// in levels, of which a parenthesis takes two and a block one. The stack does not limit expressions, this does
+	static constexpr size_t default_max_depth = 100000;
+	parser(size_t max_errors = 20, size_t max_depth = default_max_depth) : max_errors(max_errors), max_depth(max_depth) {}
+	ast::pointer_to<ast::translation_unit> parse(std::shared_ptr<token_stream> tokens);
+	// the same tree, with function bodies parsed on all cores
+	ast::pointer_to<ast::translation_unit> parse_parallel(std::shared_ptr<token_stream> tokens);
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Block scanning for the parts of the input where the lexer only looks for a few special characters
+ * (comments, string literals, attributes). Each step compares 32 (AVX2) or 16 (SSE2) bytes against all
+ * characters in question, the remainder of a region is handled bytewise. Loads never go past 'end'.
+ * Only the hand-written lexer scans this way, the DFA that flex generates from lexer.ll matches the same regions
+ * as long runs of ordinary characters instead.
+ */
+namespace scan {
+
+#if defined(__AVX2__)
+	constexpr size_t stride = 32;
+	using block = __m256i;
+	inline block load(const char *p) { return _mm256_loadu_si256((const __m256i*)p); }
+	inline block matches(block b, char c) { return _mm256_cmpeq_epi8(b, _mm256_set1_epi8(c)); }
+	inline uint32_t mask(block b) { return (uint32_t)_mm256_movemask_epi8(b); }
+#elif defined(__SSE2__)
+	constexpr size_t stride = 16;
+	using block = __m128i;
+	inline block load(const char *p) { return _mm_loadu_si128((const __m128i*)p); }
+	inline block matches(block b, char c) { return _mm_cmpeq_epi8(b, _mm_set1_epi8(c)); }
+	inline uint32_t mask(block b) { return (uint32_t)_mm_movemask_epi8(b); }
+#else
+	constexpr size_t stride = 0;
+#endif
+
+	// first occurrence of any of cs in [p, end), end if there is none
+	template<char... cs> const char* find_first_of(const char *p, const char *end) {
+#if defined(__AVX2__) || defined(__SSE2__)
+		for (; size_t(end - p) >= stride; p += stride) {
+			block b = load(p);
+			if (uint32_t m = mask((matches(b, cs) | ...)))
+				return p + __builtin_ctz(m);
+		}
+#endif
+		for (; p < end; ++p)
+			if (((*p == cs) || ...))
+				return p;
+		return end;
+	}
+}
@@ -0,0 +1,180 @@
+#include "source.h"
+#include "scan.h"
+
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+source::source(const std::string &filename) : filename(filename) {
+	// flex scans the buffer in place and requires it to end in two NULs
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw lexer_error(0, filename, "Cannot open input file.");
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		// reserve zeroed memory for input and NULs, then map the file over its beginning
+		size = st.st_size;
+		mapped = size + 2;
+		void *area = mmap(nullptr, mapped, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (area != MAP_FAILED && mmap(area, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, 0) != MAP_FAILED) {
+			madvise(area, size, MADV_SEQUENTIAL);
+			buffer = (char*)area;
+		}
+		else {
+			if (area != MAP_FAILED)
+				munmap(area, mapped);
+			mapped = 0;
+		}
+	}
+	close(fd);
+	if (!buffer) {
+		// not mappable (empty, pipe, ...): read it in one go
+		std::ifstream in(filename, std::ios::binary);
+		storage.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		size = storage.size();
+		storage.append(2, '\0');
+		buffer = storage.data();
+	}
+	// until the first linemarker the input is its own source
+	lines.mark(0, files.intern(this->filename), 1);
+}
+
+source::source(const source &whole, size_t from, size_t to) : filename(whole.filename), buffer(whole.buffer + from), size(to - from) {
+	// linemarkers without a name stay in the file before them, which is file 0 until a named one
+	files.intern(whole.files[0]);
+}
+
+source::~source() {
+	if (mapped)
+		munmap(buffer, mapped);
+}
+
+// 1-based line of the input that offset is on, a line break belongs to the line it ends
+int64_t source::input_line(int64_t offset) const {
+	std::call_once(line_breaks_indexed, [this]() {
+		const char *end = buffer + size;
+		for (const char *p = scan::find_first_of<'\n'>(buffer, end); p != end; p = scan::find_first_of<'\n'>(p+1, end))
+			line_breaks.push_back(p - buffer);
+	});
+	return std::lower_bound(line_breaks.begin(), line_breaks.end(), offset) - line_breaks.begin() + 1;
+}
+
+// columns count from 1
+location source::locate(int64_t offset) const {
+	int64_t line = input_line(offset);
+	int64_t col = offset - (line > 1 ? line_breaks[line-2] : -1);
+	auto e = lines.lookup(offset);
+	return location { files[e.file], e.line + (line - input_line(e.offset)), col };
+}
+
+std::string source::describe(const token &t) const {
+	auto loc = locate(t);
+	std::ostringstream oss;
+	oss << "token['" << t.text << "' " << token::type_string(t.type) << " " << loc.file << ":" << loc.line << "," << loc.col << "]";
+	return oss.str();
+}
+
+// line map encoding
+
+static void put_varint(std::vector<uint8_t> &out, uint64_t v) {
+	while (v >= 0x80) {
+		out.push_back(uint8_t(v) | 0x80);
+		v >>= 7;
+	}
+	out.push_back(uint8_t(v));
+}
+
+static uint64_t get_varint(const std::vector<uint8_t> &in, size_t &at) {
+	uint64_t v = 0;
+	for (int shift = 0; ; shift += 7) {
+		uint8_t b = in[at++];
+		v |= uint64_t(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return v;
+	}
+}
+
+// false if the input ends within the number or it does not fit
+static bool get_varint(const std::vector<uint8_t> &in, size_t &at, uint64_t &v) {
+	v = 0;
+	for (int shift = 0; shift < 64 && at < in.size(); shift += 7) {
+		uint8_t b = in[at++];
+		v |= uint64_t(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static uint64_t zigzag(int64_t v)     { return (uint64_t(v) << 1) ^ uint64_t(v >> 63); }
+static int64_t  unzigzag(uint64_t v)  { return int64_t(v >> 1) ^ -int64_t(v & 1); }
+
+void line_map::mark(int64_t offset, int file, int64_t line) {
+	put_varint(deltas, offset - last.offset);
+	put_varint(deltas, zigzag(file - last.file));
+	put_varint(deltas, zigzag(line - last.line));
+	last = entry { offset, file, line };
+	if (entries++ % 64 == 0)
+		checkpoints.emplace_back(last, deltas.size());
+}
+
+line_map::entry line_map::lookup(int64_t offset) const {
+	auto cp = std::upper_bound(checkpoints.begin(), checkpoints.end(), offset,
+	                           [](int64_t o, const auto &c) { return o < c.first.offset; });
+	if (cp == checkpoints.begin())
+		return checkpoints.empty() ? entry{} : cp->first;
+	--cp;
+	entry e = cp->first;
+	size_t at = cp->second;
+	while (at < deltas.size()) {
+		entry next = e;
+		next.offset     += get_varint(deltas, at);
+		next.file       += unzigzag(get_varint(deltas, at));
+		next.line       += unzigzag(get_varint(deltas, at));
+		if (next.offset > offset)
+			break;
+		e = next;
+	}
+	return e;
+}
+
+void line_map::append(const line_map &part, const std::vector<int> &file_ids) {
+	entry e;
+	size_t at = 0;
+	while (at < part.deltas.size()) {
+		e.offset     += get_varint(part.deltas, at);
+		e.file       += unzigzag(get_varint(part.deltas, at));
+		e.line       += unzigzag(get_varint(part.deltas, at));
+		mark(e.offset, file_ids[e.file], e.line);
+	}
+}
+
+bool line_map::valid(size_t files, int64_t size) const {
+	entry e;
+	size_t at = 0;
+	while (at < deltas.size()) {
+		uint64_t offset, file, line;
+		if (!get_varint(deltas, at, offset) || !get_varint(deltas, at, file) || !get_varint(deltas, at, line))
+			return false;
+		int64_t file_id;
+		if (offset > uint64_t(size - e.offset) || __builtin_add_overflow(int64_t(e.file), unzigzag(file), &file_id)
+		    || file_id < 0 || uint64_t(file_id) >= files || __builtin_add_overflow(e.line, unzigzag(line), &e.line))
+			return false;
+		e.offset += offset;
+		e.file = file_id;
+	}
+	return true;
+}
+
+std::string lexer_error::report(const source &src) const {
+	auto loc = src.locate(offset);
+	std::ostringstream oss;
+	oss << "Lexer Error: " << runtime_error::what() << " @" << loc.file << ":" << loc.line << ":" << loc.col << ", got input '" << lexeme << "'";
+	return oss.str();
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "token.h"
+
+#include <string>
+#include <string_view>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+
+// Names of all files mentioned in linemarkers, each stored once and referred to by a small id.
+struct file_table {
+	std::vector<std::string_view> names;
+	std::unordered_map<std::string_view, int> ids;
+
+	int intern(std::string_view name) {
+		auto [it, inserted] = ids.try_emplace(name, names.size());
+		if (inserted)
+			names.push_back(name);
+		return it->second;
+	}
+	std::string_view operator[](int id) const { return names[id]; }
+};
+
+/* Maps positions in the (preprocessed) input back to file and line of the original sources.
+ * Every linemarker becomes one entry, for the offset of the line following it, that is stored as three varints
+ * relative to its predecessor. Each 64th entry is also kept verbatim so that lookups only decode a short run.
+ */
+struct line_map {
+	struct entry {
+		int64_t offset = 0;
+		int file = 0;
+		int64_t line = 0;
+	};
+	std::vector<uint8_t> deltas;
+	std::vector<std::pair<entry, size_t>> checkpoints;	// entry and offset of its successor in deltas
+	entry last;
+	size_t entries = 0;
+
+	void mark(int64_t offset, int file, int64_t line);
+	entry lookup(int64_t offset) const;
+	// add the entries of a map for a later part of the input, with file ids translated
+	void append(const line_map &part, const std::vector<int> &file_ids);
+	// for deltas from elsewhere: complete entries, ascending offsets up to size, file ids below files
+	bool valid(size_t files, int64_t size) const;
+};
+
+struct location {
+	std::string_view file;
+	int64_t line, col;
+};
+
+/* The complete input file, memory-mapped (or read at once if that is not possible).
+ * Tokens do not own their text but view into this buffer, so it has to outlive the token stream.
+ * The only texts that do not exist verbatim in the input are string literals with escape sequences,
+ * their decoded version is kept here, too.
+ * Tokens only know their offset in the input. Line and column are computed when a diagnostic asks for them,
+ * from an index of all line breaks that is built the first time this happens.
+ */
+struct source {
+	std::string filename;
+	char *buffer = nullptr;	// the input, followed by two NULs. Private mapping, the lexer may write to it.
+	size_t size = 0;
+	size_t mapped = 0;		// length of the mapping, 0 if the input was read into storage
+	std::string storage;
+	std::list<std::string> decoded;	// nodes do not move, also when handed over by a part
+	file_table files;
+	line_map lines;
+	mutable std::vector<int64_t> line_breaks;
+	mutable std::once_flag line_breaks_indexed;
+
+	source(const std::string &filename);
+	// a part of another source, sharing its buffer. Decoded strings, files and linemarkers are collected separately,
+	// starting from the whole input's file 0.
+	source(const source &whole, size_t from, size_t to);
+	source(const source &) = delete;
+	~source();
+	std::string_view text() const { return std::string_view(buffer, size); }
+	std::string_view keep(std::string &&str) {
+		decoded.push_back(std::move(str));
+		return decoded.back();
+	}
+
+	int64_t input_line(int64_t offset) const;
+	location locate(int64_t offset) const;
+	location locate(const token &t) const { return locate(t.offset); }
+	std::string describe(const token &t) const;
+};
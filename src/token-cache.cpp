@@ -0,0 +1,194 @@
+#include "token-cache.h"
+#include "source.h"
+
+#include <fstream>
+#include <iterator>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* An entry is a header followed by the payload:
+ *   tokens:    count, types, spans
+ *   decoded:   count, then length and bytes of each
+ *   files:     count, then length and bytes of each name
+ *   linemarks: length and bytes of the encoded line map
+ *   printed:   length and bytes of what the lexer wrote to stdout, then the same for stderr
+ * Integers are stored as they are in memory, entries are only meant for the machine that wrote them.
+ * Bump format_version whenever the lexers' output or this layout changes.
+ */
+
+namespace {
+	constexpr char magic[8] = { 'k', 'c', 'p', 't', 'o', 'k', 'e', 'n' };
+	constexpr uint64_t format_version = 2;
+
+	struct header {
+		char magic[8];
+		uint64_t version;
+		uint64_t input_size;
+		uint64_t input_hash;
+		uint64_t payload_size;
+		uint64_t payload_hash;
+	};
+
+	// not cryptographic, eight bytes per step
+	uint64_t content_hash(const char *p, size_t n) {
+		constexpr uint64_t k1 = 0x9e3779b97f4a7c15ull, k2 = 0xbf58476d1ce4e5b9ull;
+		uint64_t h = n * k1;
+		for (; n >= 8; p += 8, n -= 8) {
+			uint64_t w;
+			memcpy(&w, p, 8);
+			h = (h ^ (w * k2)) * k1;
+			h ^= h >> 29;
+		}
+		uint64_t w = 0;
+		memcpy(&w, p, n);
+		h = (h ^ (w * k2)) * k1;
+		return h ^ (h >> 32);
+	}
+
+	struct writer {
+		std::string out;
+		void put(const void *p, size_t n) { out.append((const char*)p, n); }
+		void put(uint64_t v) { put(&v, sizeof v); }
+		void put(std::string_view s) { put(s.size()); put(s.data(), s.size()); }
+	};
+
+	struct reader {
+		const char *at, *end;
+		bool get(void *p, size_t n) {
+			if (size_t(end - at) < n)
+				return false;
+			memcpy(p, at, n);
+			at += n;
+			return true;
+		}
+		bool get(uint64_t &v) { return get(&v, sizeof v); }
+		bool get(std::string_view &s) {
+			uint64_t n;
+			if (!get(n) || size_t(end - at) < n)
+				return false;
+			s = std::string_view(at, n);
+			at += n;
+			return true;
+		}
+	};
+}
+
+token_cache::token_cache(const std::string &dir) : dir(dir) {
+	mkdir(dir.c_str(), 0777);
+}
+
+std::string token_cache::entry_path(uint64_t hash, size_t size) const {
+	char name[64];
+	snprintf(name, sizeof name, "/%016llx-%zu.tokens", (unsigned long long)hash, size);
+	return dir + name;
+}
+
+bool token_cache::load(source &src, token_array &tokens, std::string &out, std::string &err) {
+	uint64_t hash = content_hash(src.buffer, src.size);
+	std::ifstream in(entry_path(hash, src.size), std::ios::binary);
+	if (!in) {
+		misses++;
+		return false;
+	}
+	std::string entry((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+	// everything is checked before anything is handed to src, so a bad entry leaves no trace
+	auto reject = [&]() {
+		rejected++;
+		return false;
+	};
+	header h;
+	if (entry.size() < sizeof h)
+		return reject();
+	memcpy(&h, entry.data(), sizeof h);
+	const char *payload = entry.data() + sizeof h;
+	if (memcmp(h.magic, magic, sizeof magic) != 0 || h.version != format_version || h.input_size != src.size
+	    || h.input_hash != hash || h.payload_size != entry.size() - sizeof h || h.payload_hash != content_hash(payload, h.payload_size))
+		return reject();
+
+	reader r { payload, payload + h.payload_size };
+	uint64_t n;
+	if (!r.get(n) || n == 0 || n > h.payload_size)
+		return reject();
+	token_array loaded(src);
+	loaded.types.resize(n);
+	loaded.spans.resize(n);
+	if (!r.get(loaded.types.data(), n) || !r.get(loaded.spans.data(), n * sizeof(token_array::span)))
+		return reject();
+
+	std::vector<std::string_view> decoded, files;
+	for (auto *table : { &decoded, &files }) {
+		if (!r.get(n) || n > h.payload_size || (table == &files && n == 0))
+			return reject();
+		table->resize(n);
+		for (auto &s : *table)
+			if (!r.get(s))
+				return reject();
+	}
+	line_map lines;
+	std::string_view deltas, printed_out, printed_err;
+	if (!r.get(deltas) || !r.get(printed_out) || !r.get(printed_err) || r.at != r.end)
+		return reject();
+	lines.deltas.assign(deltas.begin(), deltas.end());
+	if (!lines.valid(files.size(), src.size))
+		return reject();
+
+	for (size_t i = 0; i < loaded.size(); ++i) {
+		const auto &s = loaded.spans[i];
+		if (loaded.types[i] > token::last_type || s.decoded >= int64_t(decoded.size())
+		    || s.offset > src.size || (s.decoded < 0 && s.length > src.size + 1 - s.offset))
+			return reject();
+	}
+	if (loaded.type(loaded.size()-1) != token::eof)
+		return reject();
+
+	for (auto s : decoded)
+		loaded.decoded.push_back(src.keep(std::string(s)));
+	// the first file is the input itself, which may have been called differently when the entry was written
+	std::vector<int> file_ids { 0 };
+	for (size_t i = 1; i < files.size(); ++i)
+		file_ids.push_back(src.files.intern(src.keep(std::string(files[i]))));
+	src.lines.append(lines, file_ids);
+	tokens = std::move(loaded);
+	out = printed_out;
+	err = printed_err;
+	hits++;
+	return true;
+}
+
+void token_cache::store(const source &src, const token_array &tokens, std::string_view out, std::string_view err) {
+	writer w;
+	w.put(tokens.size());
+	w.put(tokens.types.data(), tokens.types.size());
+	w.put(tokens.spans.data(), tokens.spans.size() * sizeof(token_array::span));
+	w.put(tokens.decoded.size());
+	for (auto s : tokens.decoded)
+		w.put(s);
+	w.put(src.files.names.size());
+	for (auto name : src.files.names)
+		w.put(name);
+	w.put(std::string_view((const char*)src.lines.deltas.data(), src.lines.deltas.size()));
+	w.put(out);
+	w.put(err);
+
+	header h;
+	memcpy(h.magic, magic, sizeof magic);
+	h.version = format_version;
+	h.input_size = src.size;
+	h.input_hash = content_hash(src.buffer, src.size);
+	h.payload_size = w.out.size();
+	h.payload_hash = content_hash(w.out.data(), w.out.size());
+
+	// write aside and rename, so that concurrent runs never see half an entry
+	std::string path = entry_path(h.input_hash, src.size);
+	std::string temp = path + "." + std::to_string(getpid());
+	std::ofstream file(temp, std::ios::binary);
+	file.write((const char*)&h, sizeof h);
+	file.write(w.out.data(), w.out.size());
+	file.close();
+	if (!file || rename(temp.c_str(), path.c_str()) != 0)
+		remove(temp.c_str());
+}
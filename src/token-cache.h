@@ -0,0 +1,21 @@
+#pragma once
+
+#include "token.h"
+
+#include <string>
+
+/* Token streams kept on disk, keyed by a hash of the input's contents.
+ * An entry holds everything lexing leaves behind: the tokens, decoded string literals, file names, linemarkers and
+ * what the lexer printed.
+ * Entries that do not belong to the input or fail their checksum are ignored and replaced.
+ */
+class token_cache {
+	std::string dir;
+	std::string entry_path(uint64_t hash, size_t size) const;
+public:
+	size_t hits = 0, misses = 0, rejected = 0;
+
+	token_cache(const std::string &dir);
+	bool load(source &src, token_array &tokens, std::string &out, std::string &err);
+	void store(const source &src, const token_array &tokens, std::string_view out, std::string_view err);
+};
@@ -1,4 +1,29 @@
 #include "token.h"
+#include "source.h"
+
+std::unique_ptr<lexer> lexer::make(source &src, backend kind, std::ostream &out, std::ostream &err) {
+	if (kind == parallel)
+		return std::make_unique<parallel_lexer>(src, out, err, 1);
+	if (kind == fast && parallel_lexer::worthwhile(src))
+		return std::make_unique<parallel_lexer>(src, out, err);
+	if (kind == fast)
+		return std::make_unique<fast_lexer>(src, out, err);
+	return std::make_unique<flex_lexer>(src, out, err);
+}
+
+token_array::token_array(const source &src) : base(src.buffer) {
+}
+
+void token_array::push_back(const token &t) {
+	span s { uint64_t(t.offset), uint32_t(t.text.size()), -1 };
+	assert(t.text.size() <= UINT32_MAX);
+	if (t.text.data() != base + t.offset) {
+		s.decoded = decoded.size();
+		decoded.push_back(t.text);
+	}
+	types.push_back(t.type);
+	spans.push_back(s);
+}
 
 std::string token::type_string(enum token::type t) {
 	switch (t) {
@@ -1,9 +1,18 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory>
 #include <ostream>
+#include <iostream>
 #include <sstream>
+#include <stdexcept>
+#include <type_traits>
+#include <cstdint>
+#include <cassert>
+
+struct source;
 
 struct token {
 	enum type {
@@ -31,23 +40,25 @@ struct token {
 		attribute, // the entire attribute block
 		kw_restrict,
 		// call setline('.', join(sort(split(getline('.'), ' ')), " "))
+		last_type = kw_restrict
 	};
-	int line;
-	int pos;
+	int64_t offset;
 	enum type type;
-	std::string text;
-	std::string file;
+	std::string_view text;	// views into the source buffer
 
-	token(enum type t, const std::string &str, int line, int col, const std::string &file) : type(t), text(str), line(line), pos(col), file(file) {
+	/* offset is where the text starts in the input (for decoded strings: where it would start), line and column
+	 * are only computed from it when needed, see source::locate.
+	 */
+	token(enum type t, std::string_view str, int64_t offset) : offset(offset), type(t), text(str) {
 	}
-	static token make_char(const std::string &str, int line, int col, const std::string &file) {
-		return token(character, str.substr(1, str.length()-2), line, col, file);
+	static token make_char(std::string_view str, int64_t offset) {
+		return token(character, str.substr(1, str.length()-2), offset+1);
 	}
-	static token make_string(const std::string &str, int line, int col, const std::string &file) {
-		return token(string, str, line, col, file);
+	static token make_string(std::string_view str, int64_t offset) {
+		return token(string, str, offset);
 	}
-	static token make_attribute(const std::string &str, int line, int col, const std::string &file) {
-		return token(attribute, str, line, col, file);
+	static token make_attribute(std::string_view str, int64_t offset) {
+		return token(attribute, str, offset);
 	}
 
 	bool operator==(enum type t) const { return type == t; }
@@ -56,24 +67,177 @@ struct token {
 	static std::string type_string(enum type t);
 
 	friend std::ostream& operator<<(std::ostream &out, const token &t) {
-		out << "token['" << t.text << "' " << type_string(t.type) << " " << t.file << ":" << t.line << "," << t.pos << "]";
+		out << "token['" << t.text << "' " << type_string(t.type) << " @" << t.offset << "]";
 		return out;
 	}
 };
+static_assert(std::is_trivially_copyable_v<token>, "tokens are passed around by value and must stay cheap to copy");
 
 struct lexer_error : public std::runtime_error {
-	int line, col;
+	int64_t offset;
 	std::string lexeme;
 	std::string full;
-	lexer_error(int line, int col, const std::string lexeme, const std::string &message) : runtime_error(message), line(line), col(col), lexeme(lexeme) {
+	lexer_error(int64_t offset, std::string_view lexeme, const std::string &message) : runtime_error(message), offset(offset), lexeme(lexeme) {
 		std::ostringstream oss;
-		oss << "Lexer Error: " << message << " @" << line << ":" << col << ", got input '" << lexeme << "'";
+		oss << "Lexer Error: " << message << " @" << offset << ", got input '" << lexeme << "'";
 		full = oss.str();
 	}
 	const char* what() const noexcept override {	// order noexcept/override matters to gcc 14.2.1
 		return full.c_str();
 	}
+	std::string report(const source &src) const;
+};
+
+
+/* A sequence of tokens, stored column-wise.
+ * The types are kept densely in one byte each, so that the parser's type checks touch little memory. Texts are
+ * offset and length in the source buffer, only decoded string literals are elsewhere and go to a side table.
+ */
+class token_array {
+	struct span {
+		uint64_t offset;
+		uint32_t length;
+		int32_t decoded;	// index into decoded, or -1 if the text is in the source buffer
+	};
+	static_assert(sizeof(span) == 16);
+	static_assert(token::last_type < 256, "token types are stored in a byte");
+	const char *base = nullptr;
+	std::vector<uint8_t> types;
+	std::vector<span> spans;
+	std::vector<std::string_view> decoded;
+	friend class token_cache;
+public:
+	token_array() {}
+	token_array(const source &src);
+	void push_back(const token &t);
+	size_t size() const { return types.size(); }
+	bool empty() const { return types.empty(); }
+	enum token::type type(size_t i) const { return (enum token::type)types[i]; }
+	std::string_view text(size_t i) const {
+		const span &s = spans[i];
+		return s.decoded < 0 ? std::string_view(base + s.offset, s.length) : decoded[s.decoded];
+	}
+	int64_t offset(size_t i) const { return spans[i].offset; }
+	token operator[](size_t i) const {
+		return token(type(i), text(i), offset(i));
+	}
+	token back() const { return (*this)[size()-1]; }
+};
+
+// Produces the tokens of one source. Lexers share no state, so different sources can be lexed concurrently.
+class lexer {
+public:
+	enum backend { flex, fast, parallel };
+	// what a lexer echoes and warns about goes to out and err
+	static std::unique_ptr<lexer> make(source &src, backend kind, std::ostream &out = std::cout, std::ostream &err = std::cerr);
+	virtual ~lexer() {}
+	virtual token next() = 0;
+	// lexers that produce all tokens up front hand them over here instead of through next()
+	virtual bool take_all(token_array &) { return false; }
+};
+
+// The scanner generated from lexer.ll
+class flex_lexer : public lexer {
+public:
+	struct state;
+	flex_lexer(source &src, std::ostream &out = std::cout, std::ostream &err = std::cerr);
+	flex_lexer(const flex_lexer &) = delete;
+	~flex_lexer();
+	token next() override;
+private:
+	std::unique_ptr<state> st;
+};
+
+// Hand-written scanner with the very same output as flex_lexer, see fast-lexer.cpp
+class fast_lexer : public lexer {
+public:
+	fast_lexer(source &src, std::ostream &out = std::cout, std::ostream &err = std::cerr);
+	// for a part of a larger input, offsets are relative to whole_buffer
+	fast_lexer(source &part, const char *whole_buffer, std::ostream &out, std::ostream &err);
+	token next() override;
+	// true if the input ended outside of any token, comment or linemarker
+	bool ended_between_tokens() const { return at == end && !unfinished && !in_attribute; }
+private:
+	source &src;
+	std::ostream &out, &err;	// what flex echoes and warns about
+	const char *base, *at, *end;
+	int marker_file = 0;
+	// an __attribute__ block that already returned at an inner ')'
+	bool in_attribute = false;
+	const char *attribute_start = nullptr;
+	int attrib_nest = 0;
+	bool unfinished = false;	// the input ended within a comment, string, attribute or linemarker
+
+	token end_of_input();
+	token attribute();
+	token string_literal();
+	void preprocessor_info();
+	void block_comment();
+};
+
+/* Lexes large inputs in parts on all cores, with the tokens of fast_lexer.
+ * The input is split at linemarkers and each part is lexed on its own, assuming that it starts outside of any
+ * comment. The parts are then joined in order. Where a part did not end cleanly the assumption was wrong, it is
+ * lexed again together with its successor.
+ */
+class parallel_lexer : public lexer {
+	token_array tokens;
+	size_t pos = 0;
+public:
+	parallel_lexer(source &src, std::ostream &out, std::ostream &err, size_t min_part_size = 1 << 20);
+	static bool worthwhile(const source &src);
+	token next() override {
+		return pos < tokens.size() ? tokens[pos++] : tokens.back();
+	}
+	bool take_all(token_array &into) override {
+		into = std::move(tokens);
+		return true;
+	}
 };
 
+/* Tokens pulled from a lexer as the parser asks for them.
+ * Lexing and parsing interleave, but pulled tokens are kept: nodes refer to their tokens by index (ast::token_ref),
+ * so the stream lives as long as the tree and the parser may go back to any earlier token. Indices are positions in
+ * the token sequence and every index past the end yields the eof token.
+ */
+class token_stream {
+	std::unique_ptr<lexer> lex;
+	token_array tokens;
+	size_t eof_at = SIZE_MAX;
+	size_t available(size_t i) {
+		while (i >= tokens.size() && eof_at == SIZE_MAX) {
+			token t = lex->next();
+			if (tokens.size() == max_tokens)
+				too_many(t);
+			tokens.push_back(t);
+			if (tokens.type(tokens.size()-1) == token::eof)
+				eof_at = tokens.size()-1;
+		}
+		return i > eof_at ? eof_at : i;
+	}
+	[[noreturn]] static void too_many(const token &t) {
+		throw lexer_error(t.offset, t.text, "Too many tokens, they are numbered in 32 bits");
+	}
+public:
+	// indices from here on are reserved by ast::token_ref
+	static constexpr size_t max_tokens = UINT32_MAX-2;
+
+	token_stream(source &src, lexer::backend kind = lexer::flex) : lex(lexer::make(src, kind)), tokens(src) {
+		if (lex->take_all(tokens)) {
+			if (tokens.size() > max_tokens)
+				too_many(tokens[max_tokens]);
+			eof_at = tokens.size()-1;
+		}
+	}
+	// all tokens at once, e.g. from lex_input
+	token_stream(token_array &&all) : tokens(std::move(all)), eof_at(tokens.size()-1) {
+		if (tokens.size() > max_tokens)
+			too_many(tokens[max_tokens]);
+	}
+	token operator[](size_t i)              { return tokens[available(i)]; }
+	enum token::type type(size_t i)         { return tokens.type(available(i)); }
+	std::string_view text(size_t i)         { return tokens.text(available(i)); }
+};
 
-std::vector<token> lex_input(const std::string &filename);
+class token_cache;
+token_array lex_input(source &src, lexer::backend kind = lexer::flex, token_cache *cache = nullptr);
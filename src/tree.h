@@ -1,343 +1,398 @@
 #pragma once
 
 #include "token.h"
+#include "arena.h"
 
+#include <memory>
 #include <ostream>
+#include <streambuf>
+#include <cstdint>
+#include <cassert>
 #include <string>
 #include <vector>
 
 namespace ast {
-	using std::vector;
+	// nodes and everything they hold live in the arena of their tree, short lists mostly within the node itself
+	template<typename T> using vector = std::vector<T, arena_allocator<T>>;
+	template<typename T, unsigned N> using list = small_vector<T, N>;
 	using std::tuple;
 	using std::pair;
 	
 	template<typename T> using pointer_to = T*;
 	template<typename T> T* unwrap(pointer_to<T> p) { return p; }
-	template<typename T, typename P> bool is(pointer_to<P> node) {
-		return dynamic_cast<T*>(unwrap(node)) != nullptr;
-	}
 
 
+	/* A token of the input, by its index in the token stream the tree was parsed from (see translation_unit).
+	 * Nodes keep these rather than copies of the tokens, text and location are looked up in the stream when needed.
+	 */
+	struct token_ref {
+		// no token at all, or one the parser implies, like the int of 'unsigned x'; these are in no stream
+		enum : uint32_t { implied_one = token_stream::max_tokens, implied_int, none };
+		uint32_t index = none;
+		token_ref() = default;
+		explicit token_ref(size_t index) : index(uint32_t(index)) {
+			assert(index <= implied_int && "token_stream limits the number of tokens to what fits");
+		}
+		explicit operator bool() const { return index != none; }
+
+		::token in(token_stream &tokens) const {
+			switch (index) {
+			case implied_one: return ::token(::token::integral, "1", -1);
+			case implied_int: return ::token(::token::kw_int, "int", -1);
+			default:          return tokens[index];
+			}
+		}
+		enum ::token::type type(token_stream &tokens) const { return in(tokens).type; }
+		std::string_view text(token_stream &tokens) const { return in(tokens).text; }
+		int64_t offset(token_stream &tokens) const { return in(tokens).offset; }
+	};
+	static_assert(sizeof(token_ref) == 4);
+
+	/* Every kind of node with the class it derives from, in preorder of the class hierarchy: a class is followed by
+	 * all of its subclasses. Everything that needs to know all kinds of nodes is generated from this list, adding a
+	 * kind of node takes a line here and the class below.
+	 */
+	#define ast_nodes(X) \
+		X(expression,             node)        \
+		X(conditional,            expression)  \
+		X(n_ary,                  expression)  \
+		X(sequence,               n_ary)       \
+		X(assign,                 n_ary)       \
+		X(arith,                  n_ary)       \
+		X(bitwise,                n_ary)       \
+		X(logical,                n_ary)       \
+		X(equality,               n_ary)       \
+		X(relational,             n_ary)       \
+		X(cast,                   expression)  \
+		X(unary,                  expression)  \
+		X(prefix,                 unary)       \
+		X(postfix,                unary)       \
+		X(call,                   expression)  \
+		X(subscript,              expression)  \
+		X(member_access,          expression)  \
+		X(identifier,             expression)  \
+		X(type_specifier,         identifier)  \
+		X(type_name,              type_specifier) \
+		X(type_modifier,          type_specifier) \
+		X(type_qualifier,         type_specifier) \
+		X(literal,                expression)  \
+		X(number_lit,             literal)     \
+		X(integral_lit,           number_lit)  \
+		X(float_lit,              number_lit)  \
+		X(character_lit,          literal)     \
+		X(string_lit,             literal)     \
+		X(type_expression,        expression)  \
+		X(translation_unit,       node)        \
+		X(statement,              node)        \
+		X(declaration,            statement)   \
+		X(var_declarations,       declaration) \
+		X(function_definition,    declaration) \
+		X(block,                  statement)   \
+		X(expression_stmt,        statement)   \
+		X(if_stmt,                statement)   \
+		X(switch_stmt,            statement)   \
+		X(jump_stmt,              statement)   \
+		X(return_stmt,            jump_stmt)   \
+		X(break_stmt,             jump_stmt)   \
+		X(continue_stmt,          jump_stmt)   \
+		X(goto_stmt,              jump_stmt)   \
+		X(label_stmt,             statement)   \
+		X(loop_stmt,              statement)   \
+		X(while_loop,             loop_stmt)   \
+		X(dowhile_loop,           loop_stmt)   \
+		X(for_loop,               loop_stmt)   \
+		X(struct_union,           node)        \
+		X(enumeration,            node)        \
+		X(declaration_specifiers, node)        \
+		X(declarator,             node)
+
 	struct node;
-	struct expression;
-	struct conditional;
-	struct n_ary;
-	struct sequence;
-	struct arith;
-	struct logical;
-	struct equality;
-	struct relational;
-	struct cast;
-	struct unary;
-	struct prefix;
-	struct postfix;
-	struct call;
-	struct subscript;
-	struct member_access;
-	struct identifier;
-	struct literal;
-	struct number_lit;
-	struct integral_lit;
-	struct float_lit;
-	struct character_lit;
-	struct string_lit;
-	struct type_expression;
-	
-	struct translation_unit;
-	struct type_specifier;
-	struct type_name;
-	struct type_modifier;
-	struct type_qualifier;
-	struct declaration_specifiers;
-	struct declarator;
-	struct declaration;
-	struct var_declarations;
-	struct function_definition;
-	struct struct_union;
-	struct enumeration;
-	struct block;
-	struct statement;
-	struct expression_stmt;
-	struct if_stmt;
-	struct switch_stmt;
-	struct jump_stmt;
-	struct return_stmt;
-	struct break_stmt;
-	struct continue_stmt;
-	struct goto_stmt;
-	struct label_stmt;
-	struct loop_stmt;
-	struct while_loop;
-	struct dowhile_loop;
-	struct for_loop;
+	#define declare(name, base) struct name;
+	ast_nodes(declare)
+	#undef declare
+
+	/* What a node is, as a tag set when it is made. Since kinds are numbered in the order of ast_nodes, a class and
+	 * all of its subclasses make up one range: testing for a class is one or two integer compares.
+	 */
+	enum class node_kind : uint8_t {
+		node,	// only as the root of the hierarchy, no node is just that
+		#define kind(name, base) name,
+		ast_nodes(kind)
+		#undef kind
+	};
+	inline constexpr const char *node_names[] = {
+		"node",
+		#define name(name, base) #name,
+		ast_nodes(name)
+		#undef name
+	};
+	inline constexpr node_kind node_parents[] = {
+		node_kind::node,
+		#define parent(name, base) node_kind::base,
+		ast_nodes(parent)
+		#undef parent
+	};
+	inline const char* name(node_kind k) { return node_names[size_t(k)]; }
+
+	constexpr bool derives(node_kind k, node_kind from) {
+		while (k != from && k != node_kind::node)
+			k = node_parents[size_t(k)];
+		return k == from;
+	}
+	constexpr node_kind last_derived(node_kind k) {
+		size_t last = size_t(k);
+		while (last+1 < std::size(node_parents) && derives(node_kind(last+1), k))
+			++last;
+		return node_kind(last);
+	}
+	// whether ast_nodes really is in preorder, i.e. no class has subclasses outside of its range
+	constexpr bool in_preorder() {
+		for (size_t k = 1; k < std::size(node_parents); ++k)
+			for (size_t j = size_t(last_derived(node_kind(k))) + 1; j < std::size(node_parents); ++j)
+				if (node_parents[k] >= node_kind(k) || derives(node_kind(j), node_kind(k)))
+					return false;
+		return true;
+	}
+	static_assert(in_preorder(), "ast_nodes must list every class right after its base or its base's other subclasses");
+
+	template<typename T> constexpr node_kind kind_of = node_kind::node;
+	#define kind_of(name, base) template<> constexpr node_kind kind_of<name> = node_kind::name;
+	ast_nodes(kind_of)
+	#undef kind_of
 
 	struct visitor {
-		#define forward(X) visit((X*)node)
-		virtual void visit(expression      *node) {}
-		virtual void visit(conditional     *node) { forward(expression); }
-		virtual void visit(n_ary           *node) { forward(expression); }
-		virtual void visit(sequence        *node) { forward(n_ary); }
-		virtual void visit(arith           *node) { forward(n_ary); }
-		virtual void visit(logical         *node) { forward(n_ary); }
-		virtual void visit(equality        *node) { forward(n_ary); }
-		virtual void visit(relational      *node) { forward(n_ary); }
-		virtual void visit(cast            *node) { forward(expression); }
-		virtual void visit(unary           *node) { forward(expression); }
-		virtual void visit(prefix          *node) { forward(unary); }
-		virtual void visit(postfix         *node) { forward(unary); }
-		virtual void visit(call            *node) { forward(expression); }
-		virtual void visit(subscript       *node) { forward(expression); }
-		virtual void visit(member_access   *node) { forward(expression); }
-		virtual void visit(identifier      *node) { forward(expression); }
-		virtual void visit(literal         *node) { forward(expression); }
-		virtual void visit(number_lit      *node) { forward(literal); }
-		virtual void visit(integral_lit    *node) { forward(number_lit); }
-		virtual void visit(float_lit       *node) { forward(number_lit); }
-		virtual void visit(character_lit   *node) { forward(literal); }
-		virtual void visit(string_lit      *node) { forward(literal); }
-		virtual void visit(type_expression *node) { forward(expression); }
-		
-		virtual void visit(translation_unit       *node) {}
-		virtual void visit(type_specifier         *node) { forward(identifier); }
-		virtual void visit(type_name              *node) { forward(type_specifier); }
-		virtual void visit(type_modifier          *node) { forward(type_specifier); }
-		virtual void visit(type_qualifier         *node) { forward(type_specifier); }
-		virtual void visit(declaration_specifiers *node) {}
-		virtual void visit(declarator             *node) {}
-		virtual void visit(declaration            *node) {}
-		virtual void visit(var_declarations       *node) { forward(declaration); }
-		virtual void visit(function_definition    *node) { forward(declaration); }
-		virtual void visit(struct_union           *node) { /*XXX*/ }
-		virtual void visit(enumeration            *node) { /*XXX*/ }
-		virtual void visit(block                  *node) { /*XXX*/ }
-		virtual void visit(statement              *node) { /*XXX*/ }
-		virtual void visit(expression_stmt        *node) { forward(statement); }
-		virtual void visit(if_stmt                *node) { forward(statement); }
-		virtual void visit(switch_stmt            *node) { forward(statement); }
-		virtual void visit(jump_stmt              *node) { forward(statement); }
-		virtual void visit(return_stmt            *node) { forward(jump_stmt); }
-		virtual void visit(break_stmt             *node) { forward(jump_stmt); }
-		virtual void visit(continue_stmt          *node) { forward(jump_stmt); }
-		virtual void visit(goto_stmt              *node) { forward(jump_stmt); }
-		virtual void visit(label_stmt             *node) { forward(statement); }
-		virtual void visit(loop_stmt              *node) { forward(statement); }
-		virtual void visit(while_loop             *node) { forward(loop_stmt); }
-		virtual void visit(dowhile_loop           *node) { forward(loop_stmt); }
-		virtual void visit(for_loop               *node) { forward(loop_stmt); }
-		#undef forward
+		virtual void visit(node *) {}
+		#define visit(name, base) virtual void visit(name *n) { visit((base*)n); }
+		ast_nodes(visit)
+		#undef visit
+		virtual ~visitor() {}
 	};
 
+	// nodes are not polymorphic, their tag tells what they are
 	struct node {
-// 		std::string 
-		template<typename T> bool is() { return dynamic_cast<T*>(this) != nullptr; }
-		virtual ~node() {}
-		
-		virtual void traverse_with(visitor *) = 0;
+		node_kind tag;
+		template<typename T> bool is() const { return kind_of<T> <= tag && tag <= last_derived(kind_of<T>); }
+		// calls the visitor's visit for what the node is
+		void traverse_with(visitor *v);
+		// calls f with each node directly below, which may be null
+		template<typename F> void children(F &&) {}
 	};
 
+	// LLVM style type tests, for nodes that may be null
+	template<typename T, typename P> bool isa(const P *node) {
+		return node && node->template is<T>();
+	}
+	template<typename T, typename P> T* dyn_cast(P *node) {
+		return isa<T>(node) ? static_cast<T*>(node) : nullptr;
+	}
+	template<typename T, typename P> bool is(pointer_to<P> node) {
+		return isa<T>(unwrap(node));
+	}
+
 
 	struct expression : public node {
-// 		virtual void traverse_with(visitor *) = 0; ??
 	};
 
 	struct conditional : public expression {
-		token qmark, colon;
+		token_ref qmark, colon;
 		pointer_to<expression> condition, consequent, alternative;
-		conditional(pointer_to<expression> condition, token qmark, pointer_to<expression> consequent, token colon, pointer_to<expression> alternative)
+		conditional(pointer_to<expression> condition, token_ref qmark, pointer_to<expression> consequent, token_ref colon, pointer_to<expression> alternative)
 		: qmark(qmark), colon(colon), condition(condition), consequent(consequent), alternative(alternative) {
 		}
-		virtual void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename F> void children(F &&f) { f(condition); f(consequent); f(alternative); }
 	};
 
 	struct n_ary : public expression {
-		vector<token> infix_ops;
-		vector<pointer_to<expression>> operands;
-		n_ary(token op, pointer_to<expression> lhs, pointer_to<expression> rhs) {
-			infix_ops.push_back(op);
-			operands.push_back(lhs);
-			operands.push_back(rhs);
+		// each operand with the operator before it, the first one has none
+		struct term {
+			token_ref op;
+			pointer_to<expression> operand;
+		};
+		list<term, 2> terms;
+		n_ary(token_ref op, pointer_to<expression> lhs, pointer_to<expression> rhs) {
+			terms.push_back({ token_ref(), lhs });
+			terms.push_back({ op, rhs });
 		}
-		void add(token next_operator, pointer_to<expression> next_operand) {
-			infix_ops.push_back(next_operator);
-			operands.push_back(next_operand);
+		void add(token_ref next_operator, pointer_to<expression> next_operand) {
+			terms.push_back({ next_operator, next_operand });
+		}
+		template<typename F> void children(F &&f) {
+			for (auto &t : terms)
+				f(t.operand);
 		}
-		void traverse_with(visitor *v) override { v->visit(this); }
 	};
 	
 	struct sequence : public n_ary {
-		sequence(token comma, pointer_to<expression> lhs, pointer_to<expression> rhs) : n_ary(comma, lhs, rhs) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		sequence(token_ref comma, pointer_to<expression> lhs, pointer_to<expression> rhs) : n_ary(comma, lhs, rhs) {}
 	};
 		
 	struct assign : public n_ary {
-		assign(token kind, pointer_to<expression> lhs, pointer_to<expression> rhs) : n_ary(kind, lhs, rhs) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		assign(token_ref kind, pointer_to<expression> lhs, pointer_to<expression> rhs) : n_ary(kind, lhs, rhs) {}
 	};
 	
 	struct arith : public n_ary {
-		arith(token op, pointer_to<expression> lhs, pointer_to<expression> rhs) : n_ary(op, lhs, rhs) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		arith(token_ref op, pointer_to<expression> lhs, pointer_to<expression> rhs) : n_ary(op, lhs, rhs) {}
 	};
 
 	struct bitwise : public n_ary {
-		bitwise(token op, pointer_to<expression> lhs, pointer_to<expression> rhs) : n_ary(op, lhs, rhs) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		bitwise(token_ref op, pointer_to<expression> lhs, pointer_to<expression> rhs) : n_ary(op, lhs, rhs) {}
 	};
 
 	struct logical : public n_ary {
-		logical(token op, pointer_to<expression> lhs, pointer_to<expression> rhs) : n_ary(op, lhs, rhs) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		logical(token_ref op, pointer_to<expression> lhs, pointer_to<expression> rhs) : n_ary(op, lhs, rhs) {}
 	};
 
 	struct equality : public n_ary {
-		equality(token op, pointer_to<expression> lhs, pointer_to<expression> rhs) : n_ary(op, lhs, rhs) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		equality(token_ref op, pointer_to<expression> lhs, pointer_to<expression> rhs) : n_ary(op, lhs, rhs) {}
 };
 
 	struct relational : public n_ary {
-		relational(token op, pointer_to<expression> lhs, pointer_to<expression> rhs) : n_ary(op, lhs, rhs) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		relational(token_ref op, pointer_to<expression> lhs, pointer_to<expression> rhs) : n_ary(op, lhs, rhs) {}
 	};
 
 	struct cast : public expression {
-		::token closing_paren;
+		token_ref closing_paren;
 		pointer_to<expression> type; // is this an expression?
 		pointer_to<expression> expr;
-		cast(::token closing_paren, pointer_to<expression> type, pointer_to<expression> expr) : closing_paren(closing_paren), type(type), expr(expr) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		cast(token_ref closing_paren, pointer_to<expression> type, pointer_to<expression> expr) : closing_paren(closing_paren), type(type), expr(expr) {}
+		template<typename F> void children(F &&f) { f(type); f(expr); }
 	};
 
 	struct unary : public expression {
-		::token op;
+		token_ref op;
 		pointer_to<expression> sub;
-		unary(::token op, pointer_to<expression> sub) : op(op), sub(sub) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		unary(token_ref op, pointer_to<expression> sub) : op(op), sub(sub) {}
+		template<typename F> void children(F &&f) { f(sub); }
 	};
 
 	struct prefix : public unary {
-		prefix(::token op, pointer_to<expression> sub) : unary(op, sub) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		prefix(token_ref op, pointer_to<expression> sub) : unary(op, sub) {}
 	};
 
 	struct postfix : public unary {
-		postfix(::token op, pointer_to<expression> sub) : unary(op, sub) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		postfix(token_ref op, pointer_to<expression> sub) : unary(op, sub) {}
 	};
 
 	struct call : public expression {
-		::token opening_paren;
+		token_ref opening_paren;
 		pointer_to<expression> callee;
-		vector<pointer_to<expression>> arguments;
-		call(::token opening_paren, pointer_to<expression> callee) : opening_paren(opening_paren), callee(callee) {}
+		list<pointer_to<expression>, 3> arguments;
+		call(token_ref opening_paren, pointer_to<expression> callee) : opening_paren(opening_paren), callee(callee) {}
 		void add(pointer_to<expression> arg) {
 			arguments.push_back(arg);
 		}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename F> void children(F &&f) {
+			f(callee);
+			for (auto arg : arguments)
+				f(arg);
+		}
 	};
 
 	struct subscript : public expression {
-		::token opening_bracket;
+		token_ref opening_bracket;
 		pointer_to<expression> array, index;
-		subscript(::token opening_bracket, pointer_to<expression> array, pointer_to<expression> index) : opening_bracket(opening_bracket), array(array), index(index) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		subscript(token_ref opening_bracket, pointer_to<expression> array, pointer_to<expression> index) : opening_bracket(opening_bracket), array(array), index(index) {}
+		template<typename F> void children(F &&f) { f(array); f(index); }
 	};
 
 	struct member_access : public expression {
-		::token accessor;
+		token_ref accessor;
 		pointer_to<expression> outer, inner;
-		member_access(::token accessor, pointer_to<expression> outer, pointer_to<expression> inner) : accessor(accessor), outer(outer), inner(inner) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		member_access(token_ref accessor, pointer_to<expression> outer, pointer_to<expression> inner) : accessor(accessor), outer(outer), inner(inner) {}
+		template<typename F> void children(F &&f) { f(outer); f(inner); }
 	};
 
 	struct identifier : public expression {
-		::token token;
-		identifier(::token token) : token(token) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		token_ref token;
+		identifier(token_ref token) : token(token) {}
 	};
 	
 	struct literal : public expression {
-		::token token;
-		literal(::token token) : token(token) {}
+		token_ref token;
+		literal(token_ref token) : token(token) {}
 	};
 
 	struct number_lit : public literal {
-		number_lit(::token t) : literal(t) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		number_lit(token_ref t) : literal(t) {}
 	};
 
 	struct integral_lit : public number_lit {
-		integral_lit(::token t) : number_lit(t) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		integral_lit(token_ref t) : number_lit(t) {}
 	};
 
 	struct float_lit : public number_lit {
-		float_lit(::token t) : number_lit(t) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		float_lit(token_ref t) : number_lit(t) {}
 	};
 
 	struct character_lit : public literal {
-		character_lit(::token t) : literal(t) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		character_lit(token_ref t) : literal(t) {}
 	};
 
 	struct string_lit : public literal {
-		string_lit(::token t) : literal(t) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		string_lit(token_ref t) : literal(t) {}
 	};
 
 	struct type_expression : public expression { // in sizeof
 		pointer_to<declaration_specifiers> specifiers;
 		pointer_to<ast::declarator> declarator;
 		type_expression(pointer_to<declaration_specifiers> specifiers, pointer_to<ast::declarator> declarator) : specifiers(specifiers), declarator(declarator) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename F> void children(F &&f) { f(specifiers); f(declarator); }
 	};
 
 
 
+	/* Not in an arena itself, but keeps the arenas of its nodes and the token streams they refer to: deleting it
+	 * drops the whole tree at once. The texts of the tokens are still views into the source, which must outlive the tree.
+	 * A tree usually refers to one stream only, one that reuses declarations of an earlier tree to several.
+	 */
 	struct translation_unit : public node {
+		std::vector<std::shared_ptr<arena>> memory;
+		std::vector<std::shared_ptr<token_stream>> streams;
 		vector<pointer_to<node>> toplevel; // XXX 
-		void add(pointer_to<node> stmt) {  // XXX use statement node type
+		vector<uint32_t> stream_of;	// per toplevel node, into streams
+		void add(pointer_to<node> stmt, uint32_t stream = 0) {  // XXX use statement node type
 			toplevel.push_back(stmt);
+			stream_of.push_back(stream);
+		}
+		translation_unit() { tag = kind_of<translation_unit>; }
+		token_stream& tokens_of(size_t i) { return *streams[stream_of[i]]; }
+		template<typename F> void children(F &&f) {
+			for (auto x : toplevel)
+				f(x);
 		}
-		void traverse_with(visitor *v) override { v->visit(this); }
 	};
 	
 
 	
 	struct statement : public node {
-		void traverse_with(visitor *v) override { v->visit(this); }
 	};
 
 
 	struct type_specifier : public identifier {
-		type_specifier(::token name) : identifier(name) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		type_specifier(token_ref name) : identifier(name) {}
 	};
 
 	// void, int, float, double
 	struct type_name : public type_specifier {
-		type_name(::token name) : type_specifier(name) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		type_name(token_ref name) : type_specifier(name) {}
 	};
 
 	// unsigned, signed, short, long
 	struct type_modifier : public type_specifier {
-		type_modifier(::token name) : type_specifier(name) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		type_modifier(token_ref name) : type_specifier(name) {}
 	};
 
 	// const volatile
 	struct type_qualifier : public type_specifier {
-		type_qualifier(::token name) : type_specifier(name) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		type_qualifier(token_ref name) : type_specifier(name) {}
 	};
 
 	struct struct_union : public node { // XXX what base should this use?
-		token kind;
+		token_ref kind;
 		pointer_to<identifier> struct_name = nullptr, union_name = nullptr;
 		vector<pointer_to<declaration>> declarations;
-		struct_union(token kind, pointer_to<identifier> name) : kind(kind) {
-			if (kind == token::kw_struct)
+		struct_union(token_ref kind, bool is_struct, pointer_to<identifier> name) : kind(kind) {
+			if (is_struct)
 				struct_name = name;
 			else
 				union_name = name;
@@ -348,7 +403,11 @@ namespace ast {
 		void add(pointer_to<declaration> decl) {
 			declarations.push_back(decl);
 		}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename F> void children(F &&f) {
+			f(name());
+			for (auto x : declarations)
+				f(x);
+		}
 	};
 
 	struct enumeration : public node { // XXX what base should this use?
@@ -359,11 +418,17 @@ namespace ast {
 		void add(pointer_to<identifier> enumerator, pointer_to<expression> value = nullptr) {
 			enumerators.emplace_back(enumerator, value);
 		}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename F> void children(F &&f) {
+			f(name);
+			for (auto [n, v] : enumerators) {
+				f(n);
+				f(v);
+			}
+		}
 	};
 
 	struct declaration_specifiers : public node {
-		vector<pointer_to<type_specifier>> specifiers;
+		list<pointer_to<type_specifier>, 2> specifiers;
 		declaration_specifiers() = default;
 		pointer_to<node> type = nullptr; // XXX do we have a more concrete type for "type"?
 		void add(pointer_to<type_specifier> spec) {
@@ -372,22 +437,26 @@ namespace ast {
 		void add(pointer_to<type_name> spec) {
 			specifiers.push_back(spec);
 		}
-		bool is_typedef() const {
+		bool is_typedef(token_stream &tokens) const {
 			for (auto x : specifiers)
-				if (x->token == token::kw_typedef)
+				if (x->token.type(tokens) == ::token::kw_typedef)
 					return true;
 			return false;
 		}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename F> void children(F &&f) {
+			for (auto x : specifiers)
+				f(x);
+			f(type);
+		}
 	};
 
 	struct declarator : public node {
 		struct pointer_qualifier {
 			bool c, v, r;
 		};
-		vector<pointer_qualifier> pointer;
-		vector<pointer_to<expression>> array;  // nullptr-entries correspond do unsized dimensions
-		vector<pointer_to<declaration>> fn_params; // if single entry is nullptr then this has no specified arguments (ie arbitrary)
+		list<pointer_qualifier, 2> pointer;
+		list<pointer_to<expression>, 1> array;  // nullptr-entries correspond do unsized dimensions
+		list<pointer_to<declaration>, 3> fn_params; // if single entry is nullptr then this has no specified arguments (ie arbitrary)
 		bool ellipsis = false;
 		pointer_to<identifier> name;
 		void add_pointer(bool c, bool v, bool r) {
@@ -399,23 +468,30 @@ namespace ast {
 		void add_parameter(pointer_to<declaration> param) {
 			fn_params.push_back(param);
 		}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename F> void children(F &&f) {
+			f(name);
+			for (auto x : array)
+				f(x);
+			for (auto x : fn_params)
+				f(x);
+		}
 	};
 
 	struct declaration : public statement {
 		pointer_to<declaration_specifiers> specifiers;
-		vector<token> attributes;
+		vector<token_ref> attributes;
 		declaration(pointer_to<declaration_specifiers> specifiers) : specifiers(specifiers) {
 		}
-		void add_attribute(token t) {
+		void add_attribute(token_ref t) {
 			attributes.push_back(t);
 		}
+		template<typename F> void children(F &&f) { f(specifiers); }
 	};
 
 	struct var_declarations : public declaration {
-		vector<tuple<pointer_to<declarator>,
-		             pointer_to<expression>,
-		             pointer_to<expression>>> init_declarators;
+		list<tuple<pointer_to<declarator>,
+		           pointer_to<expression>,
+		           pointer_to<expression>>, 1> init_declarators;
 		var_declarations(pointer_to<declaration_specifiers> specifiers) : declaration(specifiers) {
 		}
 		var_declarations(pointer_to<declaration_specifiers> specifiers,
@@ -430,7 +506,14 @@ namespace ast {
 		void add_width_decl(pointer_to<declarator> declarator, pointer_to<expression> fieldwidth) {
 			init_declarators.emplace_back(declarator, nullptr, fieldwidth);
 		}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename F> void children(F &&f) {
+			declaration::children(f);
+			for (auto [decl, init, width] : init_declarators) {
+				f(decl);
+				f(init);
+				f(width);
+			}
+		}
 	};
 	
 	struct function_definition : public declaration {
@@ -439,20 +522,27 @@ namespace ast {
 		function_definition(pointer_to<declaration_specifiers> spec, pointer_to<ast::declarator> decl, pointer_to<ast::block> block)
 		: declaration(spec), declarator(decl), block(block) {
 		}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename F> void children(F &&f) {
+			declaration::children(f);
+			f(declarator);
+			f(block);
+		}
 	};
 
 	struct block : public statement {
-		vector<pointer_to<statement>> statements;
+		list<pointer_to<statement>, 2> statements;
 		block() {}
-		block(const vector<pointer_to<statement>> &stmts) : statements(stmts) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename Range> block(const Range &stmts) : statements(stmts) {}
+		template<typename F> void children(F &&f) {
+			for (auto x : statements)
+				f(x);
+		}
 	};
 
 	struct expression_stmt : public statement {
 		pointer_to<ast::expression> expression;
 		expression_stmt(pointer_to<ast::expression> expr) : expression(expr) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename F> void children(F &&f) { f(expression); }
 	};
 
 	struct if_stmt : public statement {
@@ -461,7 +551,7 @@ namespace ast {
 		if_stmt(pointer_to<ast::expression> condition, pointer_to<statement> consequent, pointer_to<statement> alternate = nullptr)
 		: condition(condition), consequent(consequent), alternate(alternate) {
 		}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename F> void children(F &&f) { f(condition); f(consequent); f(alternate); }
 	};
 
 	struct switch_stmt : public statement {
@@ -470,60 +560,53 @@ namespace ast {
 		switch_stmt(pointer_to<ast::expression> expression, pointer_to<statement> body)
 		: expression(expression), body(body) {
 		}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename F> void children(F &&f) { f(expression); f(body); }
 	};
 
 	struct jump_stmt : public statement {
-		token kind;
+		token_ref kind;
 		pointer_to<ast::expression> expression; // ID for goto, return expression for return
-		jump_stmt(token kind, pointer_to<ast::expression> expr = nullptr) : kind(kind), expression(expr) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		jump_stmt(token_ref kind, pointer_to<ast::expression> expr = nullptr) : kind(kind), expression(expr) {}
+		template<typename F> void children(F &&f) { f(expression); }
 	};
 
 	struct return_stmt : public jump_stmt {
-		return_stmt(token t, pointer_to<ast::expression> expr = nullptr) : jump_stmt(t, expr) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		return_stmt(token_ref t, pointer_to<ast::expression> expr = nullptr) : jump_stmt(t, expr) {}
 	};
 
 	struct break_stmt : public jump_stmt {
-		break_stmt(token t) : jump_stmt(t) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		break_stmt(token_ref t) : jump_stmt(t) {}
 	};
 
 	struct continue_stmt : public jump_stmt {
-		continue_stmt(token t) : jump_stmt(t) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		continue_stmt(token_ref t) : jump_stmt(t) {}
 	};
 
 	struct goto_stmt : public jump_stmt {
-		goto_stmt(token t, pointer_to<ast::expression> expr = nullptr) : jump_stmt(t, expr) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		goto_stmt(token_ref t, pointer_to<ast::expression> expr = nullptr) : jump_stmt(t, expr) {}
 	};
 
 	struct label_stmt : public statement {
-		token *keyword = nullptr;
+		token_ref keyword;
 		pointer_to<ast::expression> label;
-		label_stmt(token t, pointer_to<ast::expression> expr = nullptr) : keyword(new token(t)), label(expr) {}
+		label_stmt(token_ref t, pointer_to<ast::expression> expr = nullptr) : keyword(t), label(expr) {}
 		label_stmt(pointer_to<ast::expression> expr = nullptr) : label(expr) {}
-		~label_stmt() { delete keyword; }
-		void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename F> void children(F &&f) { f(label); }
 	};
 
 	struct loop_stmt : public statement {
 		pointer_to<ast::expression> condition;
 		pointer_to<ast::statement> body;
 		loop_stmt(pointer_to<ast::expression> condition, pointer_to<ast::statement> body) : condition(condition), body(body) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename F> void children(F &&f) { f(condition); f(body); }
 	};
 
 	struct while_loop : public loop_stmt {
 		while_loop(pointer_to<ast::expression> condition, pointer_to<ast::statement> body) : loop_stmt(condition, body) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
 	};
 
 	struct dowhile_loop : public loop_stmt {
 		dowhile_loop(pointer_to<ast::expression> condition, pointer_to<ast::statement> body) : loop_stmt(condition, body) {}
-		void traverse_with(visitor *v) override { v->visit(this); }
 	};
 
 	struct for_loop : public loop_stmt {
@@ -532,24 +615,130 @@ namespace ast {
 		for_loop(pointer_to<statement> init, pointer_to<ast::expression> condition, pointer_to<expression> step, pointer_to<ast::statement> body)
 		: loop_stmt(condition, body), init(init), step(step) {
 		}
-		void traverse_with(visitor *v) override { v->visit(this); }
+		template<typename F> void children(F &&f) { f(init); f(condition); f(step); f(body); }
 	};
 
 
 
-	template<typename T, typename... Args> pointer_to<T> make_node(Args... args) {
-		return new T(std::forward<Args>(args)...);
+	template<typename T, typename... Args> pointer_to<T> make_node(Args&&... args) {
+		auto n = arena::current().make<T>(std::forward<Args>(args)...);
+		n->tag = kind_of<T>;
+		return n;
 	}
-	template<typename T> void free_node(pointer_to<T> p) {
-		delete p;
+
+	inline void node::traverse_with(visitor *v) {
+		switch (tag) {
+		#define dispatch(name, base) case node_kind::name: return v->visit(static_cast<name*>(this));
+		ast_nodes(dispatch)
+		#undef dispatch
+		case node_kind::node: return v->visit(this);
+		}
 	}
 
+	// calls f with each node directly below n, which may be null
+	template<typename F> void for_each_child(node *n, F &&f) {
+		switch (n->tag) {
+		#define children(name, base) case node_kind::name: return static_cast<name*>(n)->children(f);
+		ast_nodes(children)
+		#undef children
+		case node_kind::node: return;
+		}
+	}
 
-	struct printer : public visitor {
-		std::ostream &out;
+	/* Calls pre for each node of the tree below root before its children, and post after them.
+	 * The nodes still to be done are kept on the heap rather than the call stack, so that trees of any depth can be
+	 * walked. The default visit of static_visitor recurses instead, visitors relying on it need trees that the stack
+	 * can hold; the printer defers the children it traverses to a stack as this does.
+	 */
+	template<typename Pre, typename Post> void walk_tree(node *root, Pre &&pre, Post &&post) {
+		struct pending {
+			node *n;
+			bool entered;	// pre was called, the children are on the stack above it
+		};
+		std::vector<pending> stack { { root, false } };
+		std::vector<node*> below;
+		while (!stack.empty()) {
+			pending &top = stack.back();
+			node *n = top.n;
+			if (top.entered) {
+				stack.pop_back();
+				post(n);
+				continue;
+			}
+			top.entered = true;
+			pre(n);
+			below.clear();
+			for_each_child(n, [&](node *child) {
+				if (child)
+					below.push_back(child);
+			});
+			for (auto c = below.rbegin(); c != below.rend(); ++c)
+				stack.push_back({ *c, false });
+		}
+	}
+
+	/* A visitor without virtual calls, so that what it does can be inlined. Derived overloads visit for the kinds of
+	 * nodes it cares about and brings in the others with 'using static_visitor<Derived>::visit'. Those handle a node
+	 * as its base class would, down to visit(node*), which goes on with the children.
+	 */
+	template<typename Derived> struct static_visitor {
+		Derived& derived() { return static_cast<Derived&>(*this); }
+		// calls the visit for what n is
+		void traverse(node *n) {
+			switch (n->tag) {
+			#define dispatch(name, base) case node_kind::name: return derived().visit(static_cast<name*>(n));
+			ast_nodes(dispatch)
+			#undef dispatch
+			case node_kind::node: return derived().visit(n);
+			}
+		}
+		// traverses the nodes directly below n, in source order
+		void walk(node *n) {
+			for_each_child(n, [this](node *child) {
+				if (child)
+					derived().traverse(child);
+			});
+		}
+
+		void visit(node *n) { walk(n); }
+		#define visit(name, base) void visit(name *n) { derived().visit(static_cast<base*>(n)); }
+		ast_nodes(visit)
+		#undef visit
+	};
+
+
+	/* Prints a tree as s-expressions. A visit prints its node around the children it traverses, but the children are
+	 * only visited after it, from a stack of what is still to be printed, so that printing does not recurse.
+	 */
+	struct printer : public static_visitor<printer> {
+		std::ostream &dest;
+		struct text_buffer : std::streambuf {	// keeps its capacity when cleared, unlike std::stringbuf
+			std::string text;
+			int_type overflow(int_type c) override {
+				if (!traits_type::eq_int_type(c, traits_type::eof()))
+					text += traits_type::to_char_type(c);
+				return traits_type::not_eof(c);
+			}
+			std::streamsize xsputn(const char *s, std::streamsize n) override { text.append(s, n); return n; }
+		} after;	// what the visit running printed after a child it traversed
+		std::ostream out;	// prints into dest up to the first child, into 'after' from there on
 		int indent_size = 0;
-		printer(std::ostream &out) : out(out) {}
+		token_stream *tokens = nullptr;	// of the toplevel node being printed
+		struct pending {	// text to print, or a node to visit with the indentation and tokens it was traversed with
+			node *n;
+			std::string text;
+			int indent_size;
+			token_stream *tokens;
+		};
+		std::vector<pending> todo, traversed;
+		printer(std::ostream &dest) : dest(dest), out(dest.rdbuf()) {}
+		std::string_view text(token_ref t) { return t.text(*tokens); }
+		void traverse(node *n);	// n is printed once the visit that traverses it is done with what comes before it
+		void print(node *root);
+		void flush();	// what the visit printed since its last child goes before the next one
 		
+		using static_visitor::visit;
+		void visit(node *) {}	// nodes without a visit of their own print nothing, not even their children
 		std::string ind() { return "\n"+std::string(indent_size, ' '); }
 		struct indent_block {
 			printer *p;
@@ -561,33 +750,33 @@ namespace ast {
 			}
 		};
 
-		void visit(conditional *node) override;
-		void visit(n_ary *node) override;
-		void visit(cast *node) override;
-		void visit(unary *node) override;
-		void visit(call *node) override;
-		void visit(subscript *node) override;
-		void visit(member_access *node) override;
-		void visit(identifier *n) override;
-		void visit(literal *n) override;
-		void visit(string_lit *n) override;
-		void visit(type_specifier *n) override;
+		void visit(conditional *node);
+		void visit(n_ary *node);
+		void visit(cast *node);
+		void visit(unary *node);
+		void visit(call *node);
+		void visit(subscript *node);
+		void visit(member_access *node);
+		void visit(identifier *n);
+		void visit(literal *n);
+		void visit(string_lit *n);
+		void visit(type_specifier *n);
 		
-		void visit(translation_unit *n) override;
-		void visit(declaration_specifiers *n) override;
-		void visit(declarator *n) override;
-		void visit(var_declarations *n) override;
-		void visit(function_definition *n) override;
-		void visit(struct_union *n) override;
-		void visit(enumeration *n) override;
-		void visit(block *n) override;
-		void visit(expression_stmt *n) override;
-		void visit(if_stmt *n) override;
-		void visit(switch_stmt *n) override;
-		void visit(jump_stmt *n) override;
-		void visit(label_stmt *n) override;
-		void visit(loop_stmt *n) override;
-		void visit(for_loop *n) override;
+		void visit(translation_unit *n);
+		void visit(declaration_specifiers *n);
+		void visit(declarator *n);
+		void visit(var_declarations *n);
+		void visit(function_definition *n);
+		void visit(struct_union *n);
+		void visit(enumeration *n);
+		void visit(block *n);
+		void visit(expression_stmt *n);
+		void visit(if_stmt *n);
+		void visit(switch_stmt *n);
+		void visit(jump_stmt *n);
+		void visit(label_stmt *n);
+		void visit(loop_stmt *n);
+		void visit(for_loop *n);
 
 	};
 
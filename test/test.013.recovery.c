@@ -0,0 +1,9 @@
+int a = ;
+struct s { int x; int = 3; int y; };
+int f(int a) {
+	a = 1 +;
+	if (a) { a = ) ; }
+	return a;
+}
+int g(int, ) { return 0; }
+int ok;
@@ -0,0 +1,4 @@
+int main() {
+	int x = 1 @ 2;
+	return x;
+}